@@ -0,0 +1,79 @@
+/*
+ * arch/arm/mach-omap2/trace-clock.c
+ *
+ * OMAP3 trace clock: a GPTIMER counting up from the system clock, requested
+ * while traces are allocated. Keeping its functional clock enabled keeps the
+ * system clock running in idle, which is the price for timestamps that stay
+ * accurate across cpufreq transitions and idle. If no timer is available, the
+ * 32k sync counter is used instead, at a much coarser resolution.
+ *
+ * This file is released under the GPL v2.
+ */
+
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/clk.h>
+#include <linux/io.h>
+#include <linux/trace-clock.h>
+
+#include <mach/hardware.h>
+#include <plat/dmtimer.h>
+
+static struct omap_dm_timer *trace_clock_timer;
+static DEFINE_MUTEX(trace_clock_mutex);
+static int trace_clock_refcount;
+
+unsigned long omap_trace_clock_rate;
+EXPORT_SYMBOL_GPL(omap_trace_clock_rate);
+
+notrace u32 trace_clock_read32(void)
+{
+	if (likely(trace_clock_timer))
+		return omap_dm_timer_read_counter(trace_clock_timer);
+	return omap_readl(OMAP3430_32KSYNCT_BASE + 0x10);
+}
+EXPORT_SYMBOL_GPL(trace_clock_read32);
+
+void get_trace_clock(void)
+{
+	struct omap_dm_timer *timer;
+
+	mutex_lock(&trace_clock_mutex);
+	if (trace_clock_refcount++)
+		goto end;
+
+	timer = omap_dm_timer_request();
+	if (!timer) {
+		printk(KERN_WARNING "Trace clock: no GPTIMER available, "
+		       "falling back on the 32k sync counter.\n");
+		omap_trace_clock_rate = 32768;
+	} else {
+		omap_dm_timer_set_source(timer, OMAP_TIMER_SRC_SYS_CLK);
+		omap_trace_clock_rate =
+			clk_get_rate(omap_dm_timer_get_fclk(timer));
+		omap_dm_timer_set_load_start(timer, 1, 0);
+	}
+	trace_clock_timer = timer;
+	get_synthetic_tsc();
+end:
+	mutex_unlock(&trace_clock_mutex);
+}
+EXPORT_SYMBOL_GPL(get_trace_clock);
+
+void put_trace_clock(void)
+{
+	mutex_lock(&trace_clock_mutex);
+	WARN_ON(trace_clock_refcount <= 0);
+	if (--trace_clock_refcount)
+		goto end;
+
+	put_synthetic_tsc();
+	if (trace_clock_timer) {
+		omap_dm_timer_stop(trace_clock_timer);
+		omap_dm_timer_free(trace_clock_timer);
+		trace_clock_timer = NULL;
+	}
+end:
+	mutex_unlock(&trace_clock_mutex);
+}
+EXPORT_SYMBOL_GPL(put_trace_clock);
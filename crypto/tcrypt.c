@@ -57,7 +57,7 @@ static char *check[] = {
 	"cast6", "arc4", "michael_mic", "deflate", "crc32c", "tea", "xtea",
 	"khazad", "wp512", "wp384", "wp256", "tnepres", "xeta",  "fcrypt",
 	"camellia", "seed", "salsa20", "rmd128", "rmd160", "rmd256", "rmd320",
-	"lzo", "cts", "zlib", NULL
+	"lzo", "cts", "zlib", "lz4", NULL
 };
 
 static int test_cipher_jiffies(struct blkcipher_desc *desc, int enc,
@@ -458,6 +458,190 @@ out:
 	crypto_free_hash(tfm);
 }
 
+/*
+ * Fixed corpus for test_comp_speed(), one page per kind of content
+ * typically found in swapped-out anonymous memory.
+ */
+static void init_comp_speed_corpus(void)
+{
+	static const char * const words[] = {
+		"the ", "page ", "swap ", "memory ", "compressed ", "of ",
+		"and ", "kernel ", "block ", "device ", "data ", "to ",
+	};
+	u32 seed = 1;
+	unsigned int i, len;
+	u32 *p;
+
+	/* text */
+	for (i = 0; i < PAGE_SIZE; i += len) {
+		seed = seed * 1103515245 + 12345;
+		len = min_t(unsigned int, strlen(words[(seed >> 16) % 12]),
+			    PAGE_SIZE - i);
+		memcpy(tvmem[0] + i, words[(seed >> 16) % 12], len);
+	}
+
+	/* array of small records: counters, flags and nearby pointers */
+	p = (u32 *)tvmem[1];
+	for (i = 0; i < PAGE_SIZE / sizeof(u32); i += 4) {
+		seed = seed * 1103515245 + 12345;
+		p[i] = i / 4;
+		p[i + 1] = (seed >> 16) & 0x7;
+		p[i + 2] = 0xc0000000 + ((seed >> 8) & 0xfff0);
+		p[i + 3] = 0;
+	}
+
+	/* mostly zero with a few scattered words */
+	memset(tvmem[2], 0, PAGE_SIZE);
+	p = (u32 *)tvmem[2];
+	for (i = 0; i < PAGE_SIZE / sizeof(u32); i += 61) {
+		seed = seed * 1103515245 + 12345;
+		p[i] = seed;
+	}
+
+	/* incompressible */
+	for (i = 0; i < PAGE_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		tvmem[3][i] = seed >> 16;
+	}
+}
+
+static int test_comp_one(struct crypto_comp *tfm, int comp, int i,
+			 char *out, char *dec, unsigned int *clen)
+{
+	unsigned int dlen;
+
+	if (comp) {
+		dlen = 2 * PAGE_SIZE;
+		return crypto_comp_compress(tfm, tvmem[i], PAGE_SIZE,
+					    out + i * 2 * PAGE_SIZE, &dlen);
+	}
+
+	dlen = PAGE_SIZE;
+	return crypto_comp_decompress(tfm, out + i * 2 * PAGE_SIZE, clen[i],
+				      dec, &dlen);
+}
+
+static int test_comp_jiffies(struct crypto_comp *tfm, int comp, char *out,
+			     char *dec, unsigned int *clen, int sec)
+{
+	unsigned long start, end;
+	int pcount, ret;
+
+	for (start = jiffies, end = start + sec * HZ, pcount = 0;
+	     time_before(jiffies, end); pcount++) {
+		ret = test_comp_one(tfm, comp, pcount % TVMEMSIZE,
+				    out, dec, clen);
+		if (ret)
+			return ret;
+	}
+
+	printk("%d pages %scompressed in %d seconds (%d pages/s)\n",
+	       pcount, comp ? "" : "de", sec, pcount / sec);
+	return 0;
+}
+
+static int test_comp_cycles(struct crypto_comp *tfm, int comp, char *out,
+			    char *dec, unsigned int *clen)
+{
+	unsigned long cycles = 0;
+	int ret = 0;
+	int i, j;
+
+	local_bh_disable();
+	local_irq_disable();
+
+	/* Warm-up run, then the real thing. */
+	for (j = 0; j < 12; j++) {
+		for (i = 0; i < TVMEMSIZE; i++) {
+			cycles_t start, end;
+
+			start = get_cycles();
+			ret = test_comp_one(tfm, comp, i, out, dec, clen);
+			end = get_cycles();
+
+			if (ret)
+				goto out;
+
+			if (j >= 4)
+				cycles += end - start;
+		}
+	}
+
+out:
+	local_irq_enable();
+	local_bh_enable();
+
+	if (ret == 0)
+		printk("%scompression: %lu cycles/page\n", comp ? "" : "de",
+		       (cycles + 4 * TVMEMSIZE) / (8 * TVMEMSIZE));
+
+	return ret;
+}
+
+static void test_comp_speed(const char *algo, unsigned int sec)
+{
+	struct crypto_comp *tfm;
+	unsigned int clen[TVMEMSIZE], dlen, total = 0;
+	char *out, *dec;
+	int i, ret;
+
+	printk(KERN_INFO "\ntesting speed of %s\n", algo);
+
+	tfm = crypto_alloc_comp(algo, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "failed to load transform for %s: %ld\n", algo,
+		       PTR_ERR(tfm));
+		return;
+	}
+
+	out = kmalloc(TVMEMSIZE * 2 * PAGE_SIZE, GFP_KERNEL);
+	dec = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!out || !dec)
+		goto out;
+
+	init_comp_speed_corpus();
+	for (i = 0; i < TVMEMSIZE; i++) {
+		clen[i] = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(tfm, tvmem[i], PAGE_SIZE,
+					   out + i * 2 * PAGE_SIZE, &clen[i]);
+		if (ret) {
+			printk(KERN_ERR "compression failed ret=%d\n", ret);
+			goto out;
+		}
+
+		dlen = PAGE_SIZE;
+		ret = crypto_comp_decompress(tfm, out + i * 2 * PAGE_SIZE,
+					     clen[i], dec, &dlen);
+		if (ret || dlen != PAGE_SIZE ||
+		    memcmp(dec, tvmem[i], PAGE_SIZE)) {
+			printk(KERN_ERR "page %d does not round-trip\n", i);
+			goto out;
+		}
+
+		total += clen[i];
+	}
+	printk(KERN_INFO "corpus: %lu -> %u bytes (%lu%%)\n",
+	       TVMEMSIZE * PAGE_SIZE, total,
+	       total * 100 / (TVMEMSIZE * PAGE_SIZE));
+
+	for (i = 1; i >= 0; i--) {
+		if (sec)
+			ret = test_comp_jiffies(tfm, i, out, dec, clen, sec);
+		else
+			ret = test_comp_cycles(tfm, i, out, dec, clen);
+		if (ret) {
+			printk(KERN_ERR "%scompression failed ret=%d\n",
+			       i ? "" : "de", ret);
+			break;
+		}
+	}
+
+out:
+	kfree(dec);
+	kfree(out);
+	crypto_free_comp(tfm);
+}
+
 static void test_available(void)
 {
 	char **name = check;
@@ -683,6 +867,10 @@ static int do_test(int m)
 		ret += tcrypt_test("rfc4309(ccm(aes))");
 		break;
 
+	case 46:
+		ret += tcrypt_test("lz4");
+		break;
+
 	case 100:
 		ret += tcrypt_test("hmac(md5)");
 		break;
@@ -884,6 +1072,28 @@ static int do_test(int m)
 	case 399:
 		break;
 
+	case 400:
+		/* fall through */
+
+	case 401:
+		test_comp_speed("deflate", sec);
+		if (mode > 400 && mode < 500) break;
+
+	case 402:
+		test_comp_speed("lzo", sec);
+		if (mode > 400 && mode < 500) break;
+
+	case 403:
+		test_comp_speed("lz4", sec);
+		if (mode > 400 && mode < 500) break;
+
+	case 404:
+		test_comp_speed("snappy", sec);
+		if (mode > 400 && mode < 500) break;
+
+	case 499:
+		break;
+
 	case 1000:
 		test_available();
 		break;
@@ -41,6 +41,7 @@
 #include <linux/mutex.h>
 #include <linux/workqueue.h>
 #include <linux/preempt.h>
+#include <linux/ltt-core.h>
 
 extern void ram_console_enable_console(int);
 
@@ -506,6 +507,8 @@ static int apanic(struct notifier_block *this, unsigned long event,
 	if (in_panic)
 		return NOTIFY_DONE;
 	in_panic = 1;
+	/* Freeze the flight recorder traces before anything else is logged */
+	ltt_snapshot_trigger(1);
 #ifdef CONFIG_PREEMPT
 	/* Ensure that cond_resched() won't try to preempt anybody */
 	add_preempt_count(PREEMPT_ACTIVE);
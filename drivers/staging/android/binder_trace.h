@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_transaction;
+struct binder_node;
+
+/* A transaction or reply has been built and is about to be queued */
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id)
+		__field(int,		target_node)
+		__field(int,		to_proc)
+		__field(int,		to_thread)
+		__field(int,		reply)
+		__field(unsigned int,	code)
+		__field(unsigned int,	flags)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->target_node	= target_node ? target_node->debug_id : 0;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->to_thread	= t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply		= reply;
+		__entry->code		= t->code;
+		__entry->flags		= t->flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code)
+);
+
+/* A target thread has woken up and taken the transaction off its queue */
+TRACE_EVENT(binder_transaction_wakeup,
+
+	TP_PROTO(struct binder_transaction *t, s64 wait_us),
+
+	TP_ARGS(t, wait_us),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id)
+		__field(s64,		wait_us)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->wait_us	= wait_us;
+	),
+
+	TP_printk("transaction=%d queued=%lldus",
+		  __entry->debug_id, (long long)__entry->wait_us)
+);
+
+/* The transaction has been copied out to the target thread */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, s64 latency_us),
+
+	TP_ARGS(t, latency_us),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id)
+		__field(s64,		latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->latency_us	= latency_us;
+	),
+
+	TP_printk("transaction=%d latency=%lldus",
+		  __entry->debug_id, (long long)__entry->latency_us)
+);
+
+/*
+ * A binder lock was found held and the caller is about to wait for it;
+ * binder_locked follows once it is taken.  id is the pid of the owning
+ * process, or the node debug_id for node locks.
+ */
+TRACE_EVENT(binder_lock,
+
+	TP_PROTO(int id, const char *tag),
+
+	TP_ARGS(id, tag),
+
+	TP_STRUCT__entry(
+		__field(int,		id)
+		__field(const char *,	tag)
+	),
+
+	TP_fast_assign(
+		__entry->id	= id;
+		__entry->tag	= tag;
+	),
+
+	TP_printk("lock=%s id=%d", __entry->tag, __entry->id)
+);
+
+TRACE_EVENT(binder_locked,
+
+	TP_PROTO(int id, const char *tag),
+
+	TP_ARGS(id, tag),
+
+	TP_STRUCT__entry(
+		__field(int,		id)
+		__field(const char *,	tag)
+	),
+
+	TP_fast_assign(
+		__entry->id	= id;
+		__entry->tag	= tag;
+	),
+
+	TP_printk("lock=%s id=%d", __entry->tag, __entry->id)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
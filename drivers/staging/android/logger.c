@@ -24,6 +24,8 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -32,17 +34,26 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never block each other. Positions in the log are free running byte
+ * counts; logger_offset() turns them into an index into the buffer. A writer
+ * reserves its space by advancing 'reserve', pulls 'head' past the entries it
+ * is about to overwrite, copies its entry in and then publishes it by moving
+ * 'w_off' forward, in reservation order. Readers notice that they have been
+ * lapped when 'head' has moved past their own position.
+ *
+ * The mutex 'mutex' only protects the list of readers and their state.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	atomic_long_t		reserve; /* end of the last reserved entry */
+	atomic_long_t		w_off;	/* end of the last published entry */
+	atomic_long_t		head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -55,12 +66,24 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	unsigned long		r_off;	/* current read position */
 };
 
+/*
+ * Entries are assembled here before they are copied into the log, so that
+ * nothing can fault or sleep between reserving space and publishing it.
+ */
+struct logger_write_buf {
+	unsigned char		data[LOGGER_ENTRY_MAX_LEN];
+};
+static DEFINE_PER_CPU(struct logger_write_buf, logger_write_buf);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is position 'a' strictly before position 'b'? */
+#define logger_before(a, b)	((long)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -86,9 +109,10 @@ static inline struct logger_log *file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from index 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The entry may be overwritten under us; callers must check that the reader
+ * was not lapped before trusting the result.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,15 +131,11 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
- *
- * Caller must hold log->mutex.
+ * do_read_log_to_user - reads exactly 'count' bytes from index 'off' of 'log'
+ * into the user-space buffer 'buf'. Returns 'count' on success.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
@@ -124,8 +144,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -136,11 +156,62 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * reader_lapped - has a writer overwritten, or started to overwrite, the
+ * entry at the reader's position? If so pull the reader forward to the
+ * oldest entry still in the log.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int reader_lapped(struct logger_log *log, struct logger_reader *reader)
+{
+	unsigned long head;
+
+	smp_rmb();
+	head = atomic_long_read(&log->head);
+	if (!logger_before(reader->r_off, head))
+		return 0;
+
+	reader->r_off = head;
+	return 1;
+}
+
+/*
+ * logger_readable - is there a published entry at the reader's position?
+ * Pairs with the barrier before 'w_off' is advanced in do_write_log().
+ */
+static int logger_readable(struct logger_log *log,
+			   struct logger_reader *reader)
+{
+	int ret;
+
+	ret = atomic_long_read(&log->w_off) != reader->r_off;
+	smp_rmb();
+	return ret;
+}
+
+/*
+ * get_next_entry_len - returns the length of the entry at the reader's
+ * position, catching up first if the reader was lapped.
+ *
+ * Caller needs to hold log->mutex and to have checked logger_readable().
+ */
+static __u32 get_next_entry_len(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	__u32 len;
+
+	do {
+		reader_lapped(log, reader);
+		len = get_entry_len(log, logger_offset(reader->r_off));
+	} while (reader_lapped(log, reader));
+
+	return len;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -166,7 +237,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -191,20 +262,29 @@ start:
 	mutex_lock(&log->mutex);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!logger_readable(log, reader))) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	do {
+		/* get the size of the next entry */
+		ret = get_next_entry_len(log, reader);
+		if (count < ret) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		/* get exactly one entry from the log */
+		ret = do_read_log_to_user(log, logger_offset(reader->r_off),
+					  buf, ret);
+		if (ret < 0)
+			goto out;
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+		/* if a writer got to the entry while we copied it, retry */
+	} while (reader_lapped(log, reader));
+
+	reader->r_off += ret;
 
 out:
 	mutex_unlock(&log->mutex);
@@ -213,171 +293,166 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * fix_up_head - pull the head forward to the first entry that survives
+ * writing up to position 'end'.
  *
- * Caller must hold log->mutex.
+ * Writers may race here; every entry the head is pulled over has been
+ * published and is not yet being overwritten, so the one that loses the
+ * cmpxchg simply looks again.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void fix_up_head(struct logger_log *log, unsigned long end)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	unsigned long head, next;
 
-	return off;
-}
+	while (1) {
+		head = atomic_long_read(&log->head);
+		if (!logger_before(head + log->size, end))
+			break;
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+		next = head + get_entry_len(log, logger_offset(head));
+		atomic_long_cmpxchg(&log->head, head, next);
 	}
-
-	return 0;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have preemption disabled, so that the writers we wait for
+ * below are never waiting for us.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	unsigned long start, end;
+	size_t off, len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	end = atomic_long_add_return(count, &log->reserve);
+	start = end - count;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
-}
+	/* what we are about to overwrite must have been published */
+	while (logger_before(atomic_long_read(&log->w_off), end - log->size))
+		cpu_relax();
 
-/*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
- */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
-{
-	size_t len;
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. Readers check the
+	 * head after copying an entry, so move it before touching the buffer.
+	 */
+	fix_up_head(log, end);
+	smp_mb();
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	off = logger_offset(start);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
 
-	log->w_off = logger_offset(log->w_off + count);
-
+	/* publish entries in the order their space was reserved */
+	while (atomic_long_read(&log->w_off) != start)
+		cpu_relax();
+	smp_wmb();
+	atomic_long_set(&log->w_off, end);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_copy_payload - gathers 'count' bytes of payload from the iovec into
+ * 'buf'. With 'atomic' set this must not fault, and fails instead.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int do_copy_payload(unsigned char *buf, const struct iovec *iov,
+			   unsigned long nr_segs, size_t count, int atomic)
 {
-	size_t len;
+	while (nr_segs-- > 0 && count) {
+		size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len) ||
+			    __copy_from_user_inatomic(buf, iov->iov_base, len))
+				return -EFAULT;
+		} else if (copy_from_user(buf, iov->iov_base, len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		buf += len;
+		count -= len;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is gathered in a per-cpu buffer, or in a freshly allocated one if
+ * the user's pages have to be faulted in, and then goes into the log in one go.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *header;
+	unsigned char *buf, *slow_buf = NULL;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	size_t len;
+	int ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	preempt_disable();
+	buf = __get_cpu_var(logger_write_buf).data;
+	pagefault_disable();
+	ret = do_copy_payload(buf + sizeof(struct logger_entry), iov, nr_segs,
+			      len, 1);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+		slow_buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!slow_buf)
+			return -ENOMEM;
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		ret = do_copy_payload(slow_buf + sizeof(struct logger_entry),
+				      iov, nr_segs, len, 0);
+		if (ret) {
+			kfree(slow_buf);
+			return ret;
 		}
 
-		iov++;
-		ret += nr;
+		preempt_disable();
+		buf = slow_buf;
 	}
 
-	mutex_unlock(&log->mutex);
+	now = current_kernel_time();
+
+	header = (struct logger_entry *) buf;
+	header->len = len;
+	header->__pad = 0;
+	header->pid = current->tgid;
+	header->tid = current->pid;
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+
+	do_write_log(log, buf, sizeof(struct logger_entry) + len);
+	preempt_enable();
+
+	kfree(slow_buf);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
-	return ret;
+	return len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -411,7 +486,7 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = atomic_long_read(&log->head);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -465,7 +540,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -476,6 +551,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	unsigned long w_off;
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
@@ -490,10 +566,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		reader_lapped(log, reader);
+		ret = atomic_long_read(&log->w_off) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -501,8 +575,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
+		if (logger_readable(log, reader))
+			ret = get_next_entry_len(log, reader);
 		else
 			ret = 0;
 		break;
@@ -511,9 +585,16 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		w_off = atomic_long_read(&log->w_off);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = w_off;
+		while (1) {
+			unsigned long head = atomic_long_read(&log->head);
+
+			if (!logger_before(head, w_off) ||
+			    atomic_long_cmpxchg(&log->head, head, w_off) == head)
+				break;
+		}
 		ret = 0;
 		break;
 	}
@@ -552,8 +633,9 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
+	.reserve = ATOMIC_LONG_INIT(0), \
+	.w_off = ATOMIC_LONG_INIT(0), \
+	.head = ATOMIC_LONG_INIT(0), \
 	.size = SIZE, \
 };
 
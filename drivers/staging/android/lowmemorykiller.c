@@ -16,6 +16,11 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * With CONFIG_VMPRESSURE, writing 1 to .../parameters/pressure_mode kills on
+ * the reclaim-efficiency levels of mm/vmpressure.c instead: processes with an
+ * oom_adj of at least pressure_adj[level] are killed on low, medium and
+ * critical pressure, and only the first minfree level is still checked.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -43,6 +48,13 @@
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/mm_inline.h>
+#include <linux/vmpressure.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/pid_namespace.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 1;
 static int lowmem_adj[6] = {
@@ -69,6 +81,19 @@ static int lowmem_order[6] = {
 };
 static int lowmem_order_size = 6;
 
+/*
+ * With pressure_mode set, kill tasks of at least these oom_adj values on
+ * low, medium and critical memory pressure; OOM_ADJUST_MAX + 1 disables a
+ * level.
+ */
+static int lowmem_pressure_mode;
+static int lowmem_pressure_adj[VMPRESSURE_NUM_LEVELS] = {
+	OOM_ADJUST_MAX + 1,
+	12,
+	6,
+};
+static int lowmem_pressure_adj_size = VMPRESSURE_NUM_LEVELS;
+
 static struct task_struct *lowmem_deathpending;
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
@@ -79,25 +104,34 @@ static int lmk_kill_ok = 0;
 
 extern atomic_t optimize_comp_on;
 
-extern int isolate_lru_page_compcache(struct page *page);
-extern void putback_lru_page(struct page *page);
-extern unsigned int zone_id_shrink_pagelist(struct zone *zone_id,struct list_head *page_list);
-
-#define lru_to_page(_head) (list_entry((_head)->prev, struct page, lru))
-
 #define SWAP_PROCESS_DEBUG_LOG 0
 /* free RAM 8M(2048 pages) */
 #define CHECK_FREE_MEMORY 2048
 /* free swap (10240 pages) */
 #define CHECK_FREE_SWAPSPACE  10240
+/* swap requests that may be waiting for the reclaim thread */
+#define SWAP_PROCESS_MAX_PENDING 16
 
 static unsigned int check_free_memory = 0;
 
-enum pageout_io {
-	PAGEOUT_IO_ASYNC,
-	PAGEOUT_IO_SYNC,
+/* A process to push out to swap, queued for lmk_swapd */
+struct lmk_swap_request {
+	struct list_head list;
+	pid_t pid;
+	unsigned long nr_pages;		/* budget, 0 for the whole process */
+	int from_state;			/* clear lmk_kill_ok once done */
 };
 
+static LIST_HEAD(lmk_swap_queue);
+static DEFINE_SPINLOCK(lmk_swap_lock);
+static int lmk_swap_pending;
+static DECLARE_WAIT_QUEUE_HEAD(lmk_swap_wait);
+static struct task_struct *lmk_swapd;
+
+/* last request completed, for swap_process reads */
+static pid_t lmk_swap_last_pid;
+static unsigned long lmk_swap_last_reclaimed;
+
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
 static unsigned long lowmem_deathpending_timeout;
@@ -126,18 +160,95 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+static int lowmem_death_pending(void)
+{
+	/*
+	 * Note: Currently you need CONFIG_PROFILING
+	 * for this to work correctly.
+	 */
+	return lowmem_deathpending &&
+	       time_before_eq(jiffies, lowmem_deathpending_timeout);
+}
+
+/*
+ * Kill the task with the highest oom_adj of at least min_adj. Only the
+ * highest oom_adj bucket that has a task with memory left is looked at;
+ * within it, pick the task closest to target_free.
+ *
+ * Returns the size of the killed task in pages, or zero.
+ */
+static int lowmem_kill(int min_adj)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct hlist_node *pos;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int oom_adj;
 	int target_free = 0;
 	int selected_tasksize = 0;
-	int selected_target_offset;
+	int selected_target_offset = 0;
 	int selected_oom_adj;
+
+	/* adj and pressure_adj are set from userspace: stay inside the index */
+	min_adj = max(min_adj, OOM_DISABLE);
+	selected_oom_adj = min_adj;
+
+	read_lock(&tasklist_lock);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj; oom_adj--) {
+		hlist_for_each_entry(tsk, pos, oom_adj_bucket(oom_adj),
+				     oom_adj_node) {
+			struct task_struct *p;
+			int target_offset;
+
+			if (tsk->flags & PF_KTHREAD)
+				continue;
+
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
+
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			target_offset = abs(target_free - tasksize);
+			if (selected && target_offset >= selected_target_offset)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_target_offset = target_offset;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+		if (selected)
+			break;
+	}
+	if (selected) {
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize);
+
+		/*
+		 * If CONFIG_PROFILING is off, then we don't want to stall
+		 * the killer by setting lowmem_deathpending.
+		 */
+#ifdef CONFIG_PROFILING
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
+#endif
+		send_sig(SIGKILL, selected, 0);
+	}
+	read_unlock(&tasklist_lock);
+
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int rem = 0;
+	int i;
+	int min_adj = OOM_ADJUST_MAX + 1;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -148,12 +259,8 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	 * bail out right away; indicating to vmscan
 	 * that we have nothing further to offer on
 	 * this pass.
-	 *
-	 * Note: Currently you need CONFIG_PROFILING
-	 * for this to work correctly.
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (lowmem_death_pending())
 		return 0;
 
 	if (lowmem_adj_size < array_size)
@@ -162,6 +269,12 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		array_size = lowmem_minfree_size;
 	if (lowmem_order_size < array_size)
 		array_size = lowmem_order_size;
+	/*
+	 * In pressure mode kills are driven by reclaim efficiency; only the
+	 * lowest minfree level is kept as a backstop.
+	 */
+	if (lowmem_pressure_mode && array_size > 1)
+		array_size = 1;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -182,64 +295,10 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
-		int target_offset;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		target_offset = abs(target_free - tasksize);
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    target_offset >= selected_target_offset)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_target_offset = target_offset;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-
-		/*
-		 * If CONFIG_PROFILING is off, then we don't want to stall
-		 * the killer by setting lowmem_deathpending.
-		 */
-#ifdef CONFIG_PROFILING
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-#endif
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
@@ -248,93 +307,242 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+#ifdef CONFIG_VMPRESSURE
+/*
+ * Called from the vmpressure work item with the pressure level of the
+ * last reclaim window. Killing here rather than from the shrinker means
+ * we only kill when reclaim is actually failing, not merely because
+ * free memory dipped while the file cache was still cheap to drop.
+ */
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long level, void *data)
+{
+	unsigned long pressure = (unsigned long)data;
+	int min_adj;
+
+	if (!lowmem_pressure_mode || level >= lowmem_pressure_adj_size)
+		return NOTIFY_DONE;
+
+	min_adj = lowmem_pressure_adj[level];
+	lowmem_print(3, "vmpressure level %lu, pressure %lu, ma %d\n",
+		     level, pressure, min_adj);
+	if (min_adj > OOM_ADJUST_MAX || lowmem_death_pending())
+		return NOTIFY_OK;
+
+	lowmem_kill(min_adj);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure_notify,
+};
+#endif /* CONFIG_VMPRESSURE */
+
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 /*
- * zone_id_shrink_pagelist() clear page flags,
- * update the memory zone status, and swap pagelist
+ * Walk state for pushing one process out to swap. Anonymous pages are
+ * isolated from the LRU under the page table lock and handed to
+ * zone_id_shrink_pagelist() once about SWAP_CLUSTER_MAX of them have
+ * been gathered, so pageout runs in batches and never with a page table
+ * locked.
  */
+struct lmk_swap_walk {
+	struct vm_area_struct *vma;
+	struct list_head page_list;
+	unsigned long nr_isolated;	/* on page_list */
+	unsigned long nr_scanned;	/* isolated in total */
+	unsigned long nr_to_scan;
+	unsigned long nr_reclaimed;
+};
 
-static unsigned int shrink_pages(struct mm_struct *mm,
-				 struct list_head *zone0_page_list,
-				 struct list_head *zone1_page_list,
-				 unsigned int num_to_scan)
+/*
+ * zone_id_shrink_pagelist() takes pages of a single zone: split the
+ * batch by zone and reclaim each part.
+ */
+static void lmk_swap_flush(struct lmk_swap_walk *sw)
 {
-	unsigned long addr;
-	unsigned int isolate_pages_countter = 0;
-
-	struct vm_area_struct *vma = mm->mmap;
-	while (vma != NULL) {
-
-		for (addr = vma->vm_start; addr < vma->vm_end;
-		     addr += PAGE_SIZE) {
-			struct page *page;
-			/*get the page address from virtual memory address */
-			page = follow_page(vma, addr, FOLL_GET);
-
-			if (page && !IS_ERR(page)) {
-
-				put_page(page);
-				/* only moveable, anonymous and not dirty pages can be swapped  */
-				if ((!PageUnevictable(page))
-				    && (!PageDirty(page)) && ((PageAnon(page)))
-				    && (0 == page_is_file_cache(page))) {
-					switch (page_zone_id(page)) {
-					case 0:
-						if (!isolate_lru_page_compcache(page)) {
-							/* isolate page from LRU and add to temp list  */
-							/*create new page list, it will be used in shrink_page_list */
-							list_add_tail(&page->lru, zone0_page_list);
-							isolate_pages_countter++;
-						}
-						break;
-					case 1:
-						if (!isolate_lru_page_compcache(page)) {
-							/* isolate page from LRU and add to temp list  */
-							/*create new page list, it will be used in shrink_page_list */
-							list_add_tail(&page->lru, zone1_page_list);
-							isolate_pages_countter++;
-						}
-						break;
-					default:
-						break;
-					}
-				}
-			}
-
-			if (isolate_pages_countter >= num_to_scan) {
-				return isolate_pages_countter;
-			}
-		}
+	LIST_HEAD(zone_list);
+	struct page *page, *next;
+	struct zone *zone;
+
+	while (!list_empty(&sw->page_list)) {
+		page = list_first_entry(&sw->page_list, struct page, lru);
+		zone = page_zone(page);
+		list_for_each_entry_safe(page, next, &sw->page_list, lru)
+			if (page_zone(page) == zone)
+				list_move_tail(&page->lru, &zone_list);
+		sw->nr_reclaimed += zone_id_shrink_pagelist(zone, &zone_list);
+	}
+	sw->nr_isolated = 0;
+}
 
-		vma = vma->vm_next;
+static int lmk_swap_pmd_entry(pmd_t *pmd, unsigned long addr,
+			      unsigned long end, struct mm_walk *walk)
+{
+	struct lmk_swap_walk *sw = walk->private;
+	pte_t *orig_pte, *pte;
+	spinlock_t *ptl;
+	struct page *page;
+
+	orig_pte = pte = pte_offset_map_lock(walk->mm, pmd, addr, &ptl);
+	for (; addr != end; pte++, addr += PAGE_SIZE) {
+		if (!pte_present(*pte))
+			continue;
+		page = vm_normal_page(sw->vma, addr, *pte);
+		if (!page)
+			continue;
+		/*
+		 * Only anonymous, clean pages this process alone maps: pages
+		 * still shared with zygote would be faulted straight back in
+		 * by everybody else.
+		 */
+		if (!PageAnon(page) || PageUnevictable(page) ||
+		    PageDirty(page) || page_mapcount(page) != 1)
+			continue;
+		if (isolate_lru_page_compcache(page))
+			continue;
+		list_add_tail(&page->lru, &sw->page_list);
+		sw->nr_isolated++;
+		if (++sw->nr_scanned >= sw->nr_to_scan)
+			break;
 	}
+	pte_unmap_unlock(orig_pte, ptl);
 
-	return isolate_pages_countter;
+	if (sw->nr_isolated >= SWAP_CLUSTER_MAX)
+		lmk_swap_flush(sw);
+	cond_resched();
+
+	return sw->nr_scanned >= sw->nr_to_scan;
 }
 
 /*
- * swap_application_pages() will search the
- * pages which can be swapped, then call
- * zone_id_shrink_pagelist to update zone
- * status
+ * Swap out up to nr_pages anonymous pages of process pid, or all of them
+ * if nr_pages is 0. Only application processes are considered. Returns
+ * the number of pages reclaimed.
  */
-static unsigned int swap_pages(struct list_head *zone0_page_list,
-			       struct list_head *zone1_page_list)
+static unsigned long lmk_swap_process(pid_t pid, unsigned long nr_pages)
 {
-	struct zone *zone_id_0 = &NODE_DATA(0)->node_zones[0];
-	struct zone *zone_id_1 = &NODE_DATA(0)->node_zones[1];
-	unsigned int pages_counter = 0;
-
-	/*if the page list is not empty, call zone_id_shrink_pagelist to update zone status */
-	if ((zone_id_0) && (!list_empty(zone0_page_list))) {
-		pages_counter +=
-		    zone_id_shrink_pagelist(zone_id_0, zone0_page_list);
+	struct task_struct *p;
+	struct mm_struct *mm = NULL;
+	struct vm_area_struct *vma;
+	struct sysinfo ramzswap_info = { 0 };
+	struct lmk_swap_walk sw = {
+		.nr_to_scan = nr_pages ? nr_pages : ULONG_MAX,
+	};
+	struct mm_walk walk = {
+		.pmd_entry = lmk_swap_pmd_entry,
+		.private = &sw,
+	};
+
+	/*
+	 * check the free RAM and swap area,
+	 * stop the optimized compcache in cpu idle case;
+	 * leave some swap area for using in low memory case
+	 */
+	si_swapinfo(&ramzswap_info);
+	si_meminfo(&ramzswap_info);
+
+	if ((ramzswap_info.freeswap < CHECK_FREE_SWAPSPACE) ||
+	    (ramzswap_info.freeram < check_free_memory)) {
+#if SWAP_PROCESS_DEBUG_LOG > 0
+		printk(KERN_INFO "idletime compcache is ignored : free RAM %lu, free swap %lu\n",
+		ramzswap_info.freeram, ramzswap_info.freeswap);
+#endif
+		return 0;
 	}
-	if ((zone_id_1) && (!list_empty(zone1_page_list))) {
-		pages_counter +=
-		    zone_id_shrink_pagelist(zone_id_1, zone1_page_list);
+
+	rcu_read_lock();
+	p = find_task_by_pid_ns(pid, &init_pid_ns);
+	if (p && __task_cred(p)->uid > 10000)
+		mm = get_task_mm(p);
+#if SWAP_PROCESS_DEBUG_LOG > 0
+	if (mm)
+		printk(KERN_INFO "idle time compcache: swap process pid %d, name %s, oom %d, task size %ld\n",
+			p->pid, p->comm, p->signal->oom_adj, get_mm_rss(mm));
+#endif
+	rcu_read_unlock();
+	if (!mm)
+		return 0;
+
+	INIT_LIST_HEAD(&sw.page_list);
+	walk.mm = mm;
+
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!vma->anon_vma || (vma->vm_flags & (VM_LOCKED | VM_IO)))
+			continue;
+		sw.vma = vma;
+		if (walk_page_range(vma->vm_start, vma->vm_end, &walk))
+			break;
 	}
-	return pages_counter;
+	lmk_swap_flush(&sw);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	return sw.nr_reclaimed;
+}
+
+static int lmk_swapd_fn(void *unused)
+{
+	struct lmk_swap_request *req;
+	unsigned long reclaimed;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(lmk_swap_wait,
+				     lmk_swap_pending || kthread_should_stop());
+
+		spin_lock(&lmk_swap_lock);
+		if (list_empty(&lmk_swap_queue)) {
+			spin_unlock(&lmk_swap_lock);
+			continue;
+		}
+		req = list_first_entry(&lmk_swap_queue,
+				       struct lmk_swap_request, list);
+		list_del(&req->list);
+		lmk_swap_pending--;
+		spin_unlock(&lmk_swap_lock);
+
+		reclaimed = lmk_swap_process(req->pid, req->nr_pages);
+		lmk_swap_last_pid = req->pid;
+		lmk_swap_last_reclaimed = reclaimed;
+		if (req->from_state && lmk_kill_pid == req->pid)
+			lmk_kill_ok = 0;
+		kfree(req);
+	}
+
+	return 0;
+}
+
+/* Hand a process to lmk_swapd; the caller does not wait for the pageout */
+static int lmk_swap_queue_pid(pid_t pid, unsigned long nr_pages,
+			      int from_state)
+{
+	struct lmk_swap_request *req;
+
+	if (!lmk_swapd)
+		return -ENODEV;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->pid = pid;
+	req->nr_pages = nr_pages;
+	req->from_state = from_state;
+
+	spin_lock(&lmk_swap_lock);
+	if (lmk_swap_pending >= SWAP_PROCESS_MAX_PENDING) {
+		spin_unlock(&lmk_swap_lock);
+		kfree(req);
+		return -EBUSY;
+	}
+	list_add_tail(&req->list, &lmk_swap_queue);
+	lmk_swap_pending++;
+	spin_unlock(&lmk_swap_lock);
+
+	wake_up(&lmk_swap_wait);
+	return 0;
 }
 
 static ssize_t lmk_state_show(struct device *dev,
@@ -345,7 +553,9 @@ static ssize_t lmk_state_show(struct device *dev,
 
 /*
  * lmk_state_store() will called by framework,
- * the framework will send the pid of process that need to be swapped
+ * the framework will send the pid of process that need to be swapped.
+ * The whole process is queued for lmk_swapd, which clears lmk_kill_ok
+ * once it is done.
  */
 static ssize_t lmk_state_store(struct device *dev,
 			       struct device_attribute *attr,
@@ -357,84 +567,43 @@ static ssize_t lmk_state_store(struct device *dev,
 	if (atomic_read(&optimize_comp_on) != 1)
 		return size;
 
-	if (lmk_kill_ok == 1) {
-		struct task_struct *p;
-		struct task_struct *selected = NULL;
-		struct sysinfo ramzswap_info = { 0 };
-		struct mm_struct *mm_scan = NULL;
+	if (lmk_kill_ok == 1 && lmk_swap_queue_pid(lmk_kill_pid, 0, 1))
+		lmk_kill_ok = 0;
 
-		/*
-		 * check the free RAM and swap area,
-		 * stop the optimized compcache in cpu idle case;
-		 * leave some swap area for using in low memory case
-		 */
-		si_swapinfo(&ramzswap_info);
-		si_meminfo(&ramzswap_info);
+	return size;
+}
 
-		if ((ramzswap_info.freeswap < CHECK_FREE_SWAPSPACE) ||
-		    (ramzswap_info.freeram < check_free_memory)) {
-#if SWAP_PROCESS_DEBUG_LOG > 0
-			printk(KERN_INFO "idletime compcache is ignored : free RAM %lu, free swap %lu\n",
-			ramzswap_info.freeram, ramzswap_info.freeswap);
-#endif
-			lmk_kill_ok = 0;
-			return size;
-		}
+static DEVICE_ATTR(lmk_state, 0664, lmk_state_show, lmk_state_store);
 
-		read_lock(&tasklist_lock);
-		for_each_process(p) {
-			if ((p->pid == lmk_kill_pid) &&
-			    (__task_cred(p)->uid > 10000)) {
-				task_lock(p);
-				selected = p;
-				if (!selected->mm || !selected->signal) {
-					task_unlock(p);
-					selected = NULL;
-					break;
-				}
-				mm_scan = selected->mm;
-				if (mm_scan) {
-					if (selected->flags & PF_KTHREAD)
-						mm_scan = NULL;
-					else
-						atomic_inc(&mm_scan->mm_users);
-				}
-				task_unlock(selected);
+/*
+ * swap_process takes "<pid> [<pages>]" and swaps out up to that many
+ * pages of the process in the background, whether or not the screen is
+ * on, so idle applications can be compressed ahead of memory pressure.
+ * Reading it returns the pid and pages reclaimed of the last request.
+ */
+static ssize_t swap_process_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d,%lu\n", lmk_swap_last_pid,
+		       lmk_swap_last_reclaimed);
+}
 
-#if SWAP_PROCESS_DEBUG_LOG > 0
-				printk(KERN_INFO "idle time compcache: swap process pid %d, name %s, oom %d, task size %ld\n",
-					p->pid, p->comm,
-					p->signal->oom_adj,
-					get_mm_rss(p->mm));
-#endif
-				break;
-			}
-		}
-		read_unlock(&tasklist_lock);
-
-		if (mm_scan) {
-			LIST_HEAD(zone0_page_list);
-			LIST_HEAD(zone1_page_list);
-			int pages_tofree = 0, pages_freed = 0;
-
-			down_read(&mm_scan->mmap_sem);
-			pages_tofree =
-			shrink_pages(mm_scan, &zone0_page_list,
-					&zone1_page_list, 0x7FFFFFFF);
-			up_read(&mm_scan->mmap_sem);
-			mmput(mm_scan);
-			pages_freed =
-			    swap_pages(&zone0_page_list,
-				       &zone1_page_list);
-			lmk_kill_ok = 0;
+static ssize_t swap_process_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t size)
+{
+	int pid;
+	unsigned long nr_pages = 0;
+	int ret;
 
-		}
-	}
+	if (sscanf(buf, "%d %lu", &pid, &nr_pages) < 1 || pid <= 0)
+		return -EINVAL;
 
-	return size;
+	ret = lmk_swap_queue_pid(pid, nr_pages, 0);
+	return ret ? ret : size;
 }
 
-static DEVICE_ATTR(lmk_state, 0664, lmk_state_show, lmk_state_store);
+static DEVICE_ATTR(swap_process, 0664, swap_process_show, swap_process_store);
 
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
@@ -448,6 +617,9 @@ static int __init lowmem_init(void)
 	task_handoff_register(&task_nb);	
 	
 	register_shrinker(&lowmem_shrinker);
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_register_notifier(&lowmem_vmpressure_nb);
+#endif
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	for_each_zone(zone) {
@@ -459,6 +631,12 @@ static int __init lowmem_init(void)
 	high_wmark += low_wmark;
 	check_free_memory = (high_wmark != 0) ? high_wmark : CHECK_FREE_MEMORY;
 
+	lmk_swapd = kthread_run(lmk_swapd_fn, NULL, "lmk_swapd");
+	if (IS_ERR(lmk_swapd)) {
+		printk(KERN_ERR "Failed to start lmk_swapd\n");
+		lmk_swapd = NULL;
+	}
+
 	lmk_class = class_create(THIS_MODULE, "lmk");
 	if (IS_ERR(lmk_class)) {
 		printk(KERN_ERR "Failed to create class(lmk)\n");
@@ -474,6 +652,9 @@ static int __init lowmem_init(void)
 	if (device_create_file(lmk_dev, &dev_attr_lmk_state) < 0)
 		printk(KERN_ERR "Failed to create device file(%s)!\n",
 		       dev_attr_lmk_state.attr.name);
+	if (device_create_file(lmk_dev, &dev_attr_swap_process) < 0)
+		printk(KERN_ERR "Failed to create device file(%s)!\n",
+		       dev_attr_swap_process.attr.name);
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
 	return 0;
@@ -481,6 +662,17 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+	struct lmk_swap_request *req, *next;
+
+	if (lmk_swapd)
+		kthread_stop(lmk_swapd);
+	list_for_each_entry_safe(req, next, &lmk_swap_queue, list)
+		kfree(req);
+#endif
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_unregister_notifier(&lowmem_vmpressure_nb);
+#endif
 	unregister_shrinker(&lowmem_shrinker);
 	task_handoff_unregister(&task_nb);
 }
@@ -493,6 +685,12 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 module_param_array_named(order, lowmem_order, uint, &lowmem_order_size,
 			S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+#ifdef CONFIG_VMPRESSURE
+module_param_named(pressure_mode, lowmem_pressure_mode, int,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_adj, lowmem_pressure_adj, int,
+			 &lowmem_pressure_adj_size, S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
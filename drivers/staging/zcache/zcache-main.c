@@ -24,6 +24,7 @@
 #include <linux/cpu.h>
 #include <linux/highmem.h>
 #include <linux/list.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
@@ -130,6 +131,11 @@ static inline int zcache_comp_op(enum comp_op op,
  * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
  * the one unbuddied zbud uses.  The data inside a zbpg cannot be
  * read or written unless the zbpg's lock is held.
+ *
+ * The buddied and unbuddied lists are split into shards, each with its
+ * own lock, so that puts and flushes on different cpus do not serialize
+ * on a single lock.  A zbpg is placed on the shard of the cpu that
+ * created it and stays there until it is freed or evicted.
  */
 
 #define ZBH_SENTINEL  0x43214321
@@ -149,6 +155,8 @@ struct zbud_hdr {
 struct zbud_page {
 	struct list_head bud_list;
 	spinlock_t lock;
+	uint16_t shard; /* index into zbud_shards */
+	bool zombie; /* being evicted, or on the unused list */
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
 	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
@@ -161,19 +169,40 @@ struct zbud_page {
 				CHUNK_MASK) >> CHUNK_SHIFT)
 #define MAX_CHUNK	(NCHUNKS-1)
 
-static struct {
-	struct list_head list;
-	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
+#define ZBUD_NR_SHARDS	(NR_CPUS < 8 ? NR_CPUS : 8)
+
+struct zbud_shard {
+	/* protects the buddied list and all unbuddied lists of this shard */
+	spinlock_t lock;
+	unsigned long long lock_start; /* sched_clock() when lock was taken */
+	struct {
+		struct list_head list;
+		unsigned long count;
+	} unbuddied[NCHUNKS];
+	/* list N contains pages with N chunks USED and NCHUNKS-N unused */
+	/* element 0 is never used but optimizing that isn't worth it */
+	struct list_head buddied_list;
+	unsigned long buddied_count;
+} ____cacheline_aligned_in_smp;
+
+static struct zbud_shard zbud_shards[ZBUD_NR_SHARDS];
 static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 
-struct list_head zbud_buddied_list;
-static unsigned long zcache_zbud_buddied_count;
+/*
+ * Shard lock hold times, in nanoseconds.  Bucket 0 counts holds shorter
+ * than 256ns, bucket N > 0 those in [128ns << N, 256ns << N), and the
+ * last bucket additionally everything longer.  Eviction is accounted
+ * separately from the put/flush paths.
+ */
+#define ZBUD_LOCK_HIST_BUCKETS	16
+
+enum zbud_lock_hist {
+	ZBUD_HIST_PUT,
+	ZBUD_HIST_EVICT,
+	ZBUD_NR_HISTS
+};
 
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
+static unsigned long zbud_lock_hold_hist[ZBUD_NR_HISTS][ZBUD_LOCK_HIST_BUCKETS];
 
 static LIST_HEAD(zbpg_unused_list);
 static unsigned long zcache_zbpg_unused_list_count;
@@ -244,6 +273,22 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
 	return p;
 }
 
+static inline void zbud_shard_lock(struct zbud_shard *shard)
+{
+	spin_lock(&shard->lock);
+	shard->lock_start = sched_clock();
+}
+
+static inline void zbud_shard_unlock(struct zbud_shard *shard,
+					enum zbud_lock_hist hist)
+{
+	u64 held = sched_clock() - shard->lock_start;
+	int bucket = min_t(int, fls64(held >> 8), ZBUD_LOCK_HIST_BUCKETS - 1);
+
+	zbud_lock_hold_hist[hist][bucket]++;
+	spin_unlock(&shard->lock);
+}
+
 /*
  * zbud raw page management
  */
@@ -271,6 +316,7 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 		INIT_LIST_HEAD(&zbpg->bud_list);
 		zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
 		spin_lock_init(&zbpg->lock);
+		zbpg->zombie = 0;
 		if (recycled) {
 			ASSERT_INVERTED_SENTINEL(zbpg, ZBPG);
 			SET_SENTINEL(zbpg, ZBPG);
@@ -298,6 +344,7 @@ static void zbud_free_raw_page(struct zbud_page *zbpg)
 	BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
 	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
 	INVERT_SENTINEL(zbpg, ZBPG);
+	zbpg->zombie = 1;
 	spin_unlock(&zbpg->lock);
 	spin_lock(&zbpg_unused_list_spinlock);
 	list_add(&zbpg->bud_list, &zbpg_unused_list);
@@ -332,13 +379,14 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	unsigned budnum = zbud_budnum(zh), size;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	struct zbud_shard *shard = &zbud_shards[zbpg->shard];
 
-	spin_lock(&zbud_budlists_spinlock);
+	zbud_shard_lock(shard);
 	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
+	if (zbpg->zombie) {
 		/* ignore zombie page... see zbud_evict_pages() */
 		spin_unlock(&zbpg->lock);
-		spin_unlock(&zbud_budlists_spinlock);
+		zbud_shard_unlock(shard, ZBUD_HIST_PUT);
 		return;
 	}
 	size = zbud_free(zh);
@@ -346,18 +394,18 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
 	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
 		chunks = zbud_size_to_chunks(size) ;
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
+		BUG_ON(list_empty(&shard->unbuddied[chunks].list));
 		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		shard->unbuddied[chunks].count--;
+		zbud_shard_unlock(shard, ZBUD_HIST_PUT);
 		zbud_free_raw_page(zbpg);
 	} else { /* was buddied: move remaining buddy to unbuddied list */
 		chunks = zbud_size_to_chunks(zh_other->size) ;
 		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
+		shard->buddied_count--;
+		list_add_tail(&zbpg->bud_list, &shard->unbuddied[chunks].list);
+		shard->unbuddied[chunks].count++;
+		zbud_shard_unlock(shard, ZBUD_HIST_PUT);
 		spin_unlock(&zbpg->lock);
 	}
 }
@@ -369,33 +417,36 @@ static struct zbud_hdr *zbud_create(uint16_t client_id, uint16_t pool_id,
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
 	struct zbud_page *zbpg = NULL, *ztmp;
+	unsigned shard_id = raw_smp_processor_id() % ZBUD_NR_SHARDS;
+	struct zbud_shard *shard = &zbud_shards[shard_id];
 	unsigned nchunks;
 	char *to;
 	int i, found_good_buddy = 0;
 
 	nchunks = zbud_size_to_chunks(size) ;
 	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
+		zbud_shard_lock(shard);
+		if (!list_empty(&shard->unbuddied[i].list)) {
 			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
+				    &shard->unbuddied[i].list, bud_list) {
 				if (spin_trylock(&zbpg->lock)) {
 					found_good_buddy = i;
 					goto found_unbuddied;
 				}
 			}
 		}
-		spin_unlock(&zbud_budlists_spinlock);
+		zbud_shard_unlock(shard, ZBUD_HIST_PUT);
 	}
 	/* didn't find a good buddy, try allocating a new page */
 	zbpg = zbud_alloc_raw_page();
 	if (unlikely(zbpg == NULL))
 		goto out;
 	/* ok, have a page, now compress the data before taking locks */
-	spin_lock(&zbud_budlists_spinlock);
+	zbud_shard_lock(shard);
 	spin_lock(&zbpg->lock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
+	zbpg->shard = shard_id;
+	list_add_tail(&zbpg->bud_list, &shard->unbuddied[nchunks].list);
+	shard->unbuddied[nchunks].count++;
 	zh = &zbpg->buddy[0];
 	goto init_zh;
 
@@ -412,9 +463,9 @@ found_unbuddied:
 	} else
 		BUG();
 	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
+	shard->unbuddied[found_good_buddy].count--;
+	list_add_tail(&zbpg->bud_list, &shard->buddied_list);
+	shard->buddied_count++;
 
 init_zh:
 	SET_SENTINEL(zh, ZBH);
@@ -426,7 +477,7 @@ init_zh:
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
 	spin_unlock(&zbpg->lock);
-	spin_unlock(&zbud_budlists_spinlock);
+	zbud_shard_unlock(shard, ZBUD_HIST_PUT);
 
 	zbud_cumul_chunk_counts[nchunks]++;
 	atomic_inc(&zcache_zbud_curr_zpages);
@@ -448,7 +499,7 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 
 	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
 	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
+	if (zbpg->zombie) {
 		/* ignore zombie page... see zbud_evict_pages() */
 		ret = -EINVAL;
 		goto out;
@@ -482,7 +533,7 @@ static struct tmem_pool *zcache_get_pool_by_id(uint16_t cli_id,
 static void zcache_put_pool(struct tmem_pool *pool);
 
 /*
- * Flush and free all zbuds in a zbpg, then free the pageframe
+ * Flush and free all zbuds in a zombie zbpg, then free the pageframe
  */
 static void zbud_evict_zbpg(struct zbud_page *zbpg)
 {
@@ -494,6 +545,7 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	struct tmem_pool *pool;
 
 	ASSERT_SPINLOCK(&zbpg->lock);
+	BUG_ON(!zbpg->zombie);
 	BUG_ON(!list_empty(&zbpg->bud_list));
 	for (i = 0, j = 0; i < ZBUD_MAX_BUDS; i++) {
 		zh = &zbpg->buddy[i];
@@ -519,98 +571,148 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	zbud_free_raw_page(zbpg);
 }
 
+/* max number of zbpgs detached from a list per shard lock hold */
+#define ZBUD_EVICT_BATCH	16
+
 /*
- * Free nr pages.  This code is funky because we want to hold the locks
- * protecting various lists for as short a time as possible, and in some
- * circumstances the list may change asynchronously when the list lock is
- * not held.  In some cases we also trylock not only to avoid waiting on a
- * page in use by another cpu, but also to avoid potential deadlock due to
- * lock inversion.
+ * Move up to nr zbpgs from list, one of the budlists of shard, onto batch.
+ * Each is marked a zombie under its own lock, so from then on concurrent
+ * flushes and gets leave it alone and it can be evicted after the shard
+ * lock is dropped.  Pages that are busy are skipped.
+ */
+static int zbud_detach_batch(struct zbud_shard *shard, struct list_head *list,
+				unsigned long *count, int nr,
+				struct list_head *batch)
+{
+	struct zbud_page *zbpg, *ztmp;
+	int n = 0;
+
+	/* unlocked peek, an empty list is by far the common case */
+	if (list_empty(list))
+		return 0;
+	zbud_shard_lock(shard);
+	list_for_each_entry_safe(zbpg, ztmp, list, bud_list) {
+		if (n >= nr)
+			break;
+		if (unlikely(!spin_trylock(&zbpg->lock)))
+			continue;
+		zbpg->zombie = 1;
+		list_move_tail(&zbpg->bud_list, batch);
+		spin_unlock(&zbpg->lock);
+		n++;
+	}
+	*count -= n;
+	zbud_shard_unlock(shard, ZBUD_HIST_EVICT);
+	return n;
+}
+
+/*
+ * Evict up to nr zbpgs from budlist idx of each shard, where idx NCHUNKS
+ * stands for the buddied list.  Returns the number evicted.
+ */
+static int zbud_evict_list(int idx, int nr)
+{
+	static unsigned zbud_evict_cursor;
+	struct zbud_shard *shard;
+	struct zbud_page *zbpg, *ztmp;
+	LIST_HEAD(batch);
+	unsigned start = zbud_evict_cursor++;
+	int s, n, want, evicted = 0;
+
+	for (s = 0; s < ZBUD_NR_SHARDS && evicted < nr; s++) {
+		shard = &zbud_shards[(start + s) % ZBUD_NR_SHARDS];
+		do {
+			want = min(nr - evicted, ZBUD_EVICT_BATCH);
+			if (idx < NCHUNKS)
+				n = zbud_detach_batch(shard,
+					&shard->unbuddied[idx].list,
+					&shard->unbuddied[idx].count,
+					want, &batch);
+			else
+				n = zbud_detach_batch(shard,
+					&shard->buddied_list,
+					&shard->buddied_count,
+					want, &batch);
+			/* want budlists unlocked when doing zbpg eviction */
+			list_for_each_entry_safe(zbpg, ztmp, &batch, bud_list) {
+				list_del_init(&zbpg->bud_list);
+				spin_lock(&zbpg->lock);
+				zbud_evict_zbpg(zbpg);
+			}
+			evicted += n;
+		} while (n == want && evicted < nr);
+	}
+	return evicted;
+}
+
+/*
+ * Free nr pages.  We want to hold the locks protecting the various lists
+ * for as short a time as possible, so zbpgs are detached from the lists a
+ * batch at a time and only evicted once the list lock has been dropped.
+ * The zbpg locks are only trylocked, not only to avoid waiting on a page
+ * in use by another cpu, but also to avoid potential deadlock due to lock
+ * inversion.
  */
 static void zbud_evict_pages(int nr)
 {
-	struct zbud_page *zbpg;
-	int i;
+	struct zbud_page *zbpg, *ztmp;
+	LIST_HEAD(batch);
+	int i, n;
 
-	/* first try freeing any pages on unused list */
-retry_unused_list:
-	spin_lock_bh(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		/* can't walk list here, since it may change when unlocked */
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		atomic_dec(&zcache_zbud_curr_raw_pages);
-		spin_unlock_bh(&zbpg_unused_list_spinlock);
-		zcache_free_page(zbpg);
-		zcache_evicted_raw_pages++;
-		if (--nr <= 0)
-			goto out;
-		goto retry_unused_list;
-	}
-	spin_unlock_bh(&zbpg_unused_list_spinlock);
+	local_bh_disable();
 
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
+	/* first try freeing any pages on unused list */
+	while (nr > 0) {
+		n = 0;
+		spin_lock(&zbpg_unused_list_spinlock);
+		list_for_each_entry_safe(zbpg, ztmp, &zbpg_unused_list,
+								bud_list) {
+			if (n >= min(nr, ZBUD_EVICT_BATCH))
+				break;
+			list_move_tail(&zbpg->bud_list, &batch);
+			zcache_zbpg_unused_list_count--;
+			n++;
 		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
+		spin_unlock(&zbpg_unused_list_spinlock);
+		if (n == 0)
+			break;
+		list_for_each_entry_safe(zbpg, ztmp, &batch, bud_list) {
 			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
+			atomic_dec(&zcache_zbud_curr_raw_pages);
+			zcache_free_page(zbpg);
+			zcache_evicted_raw_pages++;
 		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
+		nr -= n;
 	}
 
-	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
-			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
-		local_bh_enable();
-		if (--nr <= 0)
-			goto out;
-		goto retry_bud_list;
+	/* now try freeing unbuddied pages, starting with least space avail */
+	for (i = 0; i < NCHUNKS && nr > 0; i++) {
+		n = zbud_evict_list(i, nr);
+		zcache_evicted_unbuddied_pages += n;
+		nr -= n;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
-out:
-	return;
+
+	/* as a last resort, free buddied pages */
+	if (nr > 0)
+		zcache_evicted_buddied_pages += zbud_evict_list(NCHUNKS, nr);
+
+	local_bh_enable();
 }
 
 static void zbud_init(void)
 {
-	int i;
-
-	INIT_LIST_HEAD(&zbud_buddied_list);
-	zcache_zbud_buddied_count = 0;
-	for (i = 0; i < NCHUNKS; i++) {
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
-		zbud_unbuddied[i].count = 0;
+	struct zbud_shard *shard;
+	int i, s;
+
+	for (s = 0; s < ZBUD_NR_SHARDS; s++) {
+		shard = &zbud_shards[s];
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->buddied_list);
+		shard->buddied_count = 0;
+		for (i = 0; i < NCHUNKS; i++) {
+			INIT_LIST_HEAD(&shard->unbuddied[i].list);
+			shard->unbuddied[i].count = 0;
+		}
 	}
 }
 
@@ -625,11 +727,53 @@ static int zbud_show_unbuddied_list_counts(char *buf)
 	int i;
 	char *p = buf;
 
-	for (i = 0; i < NCHUNKS; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
+	unsigned long count;
+	int s;
+
+	for (i = 0; i < NCHUNKS; i++) {
+		count = 0;
+		for (s = 0; s < ZBUD_NR_SHARDS; s++)
+			count += zbud_shards[s].unbuddied[i].count;
+		p += sprintf(p, "%lu ", count);
+	}
+	return p - buf;
+}
+
+static int zbud_show_buddied_count(char *buf)
+{
+	unsigned long count = 0;
+	int s;
+
+	for (s = 0; s < ZBUD_NR_SHARDS; s++)
+		count += zbud_shards[s].buddied_count;
+	return sprintf(buf, "%lu\n", count);
+}
+
+/*
+ * Shard lock hold time histograms, one count per bucket, see
+ * zbud_lock_hold_hist.
+ */
+static int zbud_show_lock_hold_hist(char *buf, enum zbud_lock_hist hist)
+{
+	int i;
+	char *p = buf;
+
+	for (i = 0; i < ZBUD_LOCK_HIST_BUCKETS; i++)
+		p += sprintf(p, "%lu ", zbud_lock_hold_hist[hist][i]);
+	p += sprintf(p, "\n");
 	return p - buf;
 }
 
+static int zbud_show_put_lock_hold_hist(char *buf)
+{
+	return zbud_show_lock_hold_hist(buf, ZBUD_HIST_PUT);
+}
+
+static int zbud_show_evict_lock_hold_hist(char *buf)
+{
+	return zbud_show_lock_hold_hist(buf, ZBUD_HIST_EVICT);
+}
+
 static int zbud_show_cumul_chunk_counts(char *buf)
 {
 	unsigned long i, chunks = 0, total_chunks = 0, sum_total_chunks = 0;
@@ -1458,7 +1602,6 @@ ZCACHE_SYSFS_RO(failed_pers_puts);
 ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
-ZCACHE_SYSFS_RO(zbud_buddied_count);
 ZCACHE_SYSFS_RO(zbpg_unused_list_count);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
@@ -1476,6 +1619,12 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_buddied_count,
+			zbud_show_buddied_count);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_put_lock_hold_hist,
+			zbud_show_put_lock_hold_hist);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_evict_lock_hold_hist,
+			zbud_show_evict_lock_hold_hist);
 ZCACHE_SYSFS_RO_CUSTOM(zv_curr_dist_counts,
 			zv_curr_dist_counts_show);
 ZCACHE_SYSFS_RO_CUSTOM(zv_cumul_dist_counts,
@@ -1509,6 +1658,8 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_put_to_flush_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zbud_put_lock_hold_hist_attr.attr,
+	&zcache_zbud_evict_lock_hold_hist_attr.attr,
 	&zcache_zv_curr_dist_counts_attr.attr,
 	&zcache_zv_cumul_dist_counts_attr.attr,
 	&zcache_zv_max_zsize_attr.attr,
@@ -0,0 +1,151 @@
+/*
+ * Compressed RAM block device: deduplication of identical pages
+ *
+ * Pages are hashed before compression. A page whose content matches
+ * an already stored one shares its compressed object instead of
+ * allocating a new one. Candidates with equal checksums are confirmed
+ * by decompressing them and comparing the contents.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket for this many pages of disk */
+#define ZRAM_PAGES_PER_BUCKET	8
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/**
+ * zram_dedup_find - find a stored page with the content of mem
+ * @zram: device to search
+ * @zstrm: stream used to decompress candidates; its buffer is clobbered
+ * @mem: uncompressed page
+ * @checksum: zram_dedup_checksum() of mem
+ *
+ * Returns the matching entry with a reference taken, or NULL.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+			struct zram_comp_strm *zstrm, unsigned char *mem,
+			u32 checksum)
+{
+	int ret;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct zram_entry *entry;
+	struct zram_hash *bucket = &zram->hash[checksum & zram->hash_mask];
+
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(entry, pos, &bucket->head, node) {
+		if (entry->checksum != checksum)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = zram_decompress(zstrm, cmem, entry->len, zstrm->buffer);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (!ret && !memcmp(zstrm->buffer, mem, PAGE_SIZE)) {
+			entry->refcount++;
+			spin_unlock(&bucket->lock);
+			return entry;
+		}
+	}
+	spin_unlock(&bucket->lock);
+
+	return NULL;
+}
+
+/*
+ * Make a newly stored object available for sharing. Returns its entry
+ * with one reference, or NULL if out of memory.
+ */
+struct zram_entry *zram_dedup_add(struct zram *zram, unsigned long handle,
+			unsigned int len, u32 checksum)
+{
+	struct zram_entry *entry;
+	struct zram_hash *bucket = &zram->hash[checksum & zram->hash_mask];
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->handle = handle;
+	entry->refcount = 1;
+
+	spin_lock(&bucket->lock);
+	hlist_add_head(&entry->node, &bucket->head);
+	spin_unlock(&bucket->lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference to entry. Returns 1 if it was the last one and the
+ * object has been freed, 0 otherwise.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	int refcount;
+	struct zram_hash *bucket = &zram->hash[entry->checksum &
+						zram->hash_mask];
+
+	spin_lock(&bucket->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		hlist_del(&entry->node);
+	spin_unlock(&bucket->lock);
+
+	if (refcount)
+		return 0;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+
+	return 1;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	unsigned long i, nr_buckets;
+
+	nr_buckets = roundup_pow_of_two(max_t(size_t,
+				num_pages / ZRAM_PAGES_PER_BUCKET, 1));
+
+	zram->hash = vmalloc(nr_buckets * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_buckets; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+	zram->hash_mask = nr_buckets - 1;
+
+	return 0;
+}
+
+/* All entries must have been put */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+}
@@ -23,8 +23,12 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
@@ -37,48 +41,13 @@
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
+/* Compressor used by devices until changed through comp_algorithm */
+#if defined(CONFIG_ZRAM_LZ4)
+#define ZRAM_DEFAULT_COMPRESSOR	"lz4"
 #elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
+#define ZRAM_DEFAULT_COMPRESSOR	"snappy"
 #else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
+#define ZRAM_DEFAULT_COMPRESSOR	"lzo"
 #endif
 
 /* Globals */
@@ -88,14 +57,14 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 unsigned int zram_num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -117,39 +86,182 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * Table entries are modified only with the entry's ZRAM_ACCESS bit
+ * held, so plain (non-atomic) updates of the value word are safe.
+ */
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static u32 zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value & ZRAM_SIZE_MASK;
+}
+
+static void zram_set_obj_size(struct zram *zram, u32 index, u32 size)
+{
+	zram->table[index].value = (zram->table[index].value &
+				    ~ZRAM_SIZE_MASK) | size;
 }
 
-static int page_zero_filled(void *ptr)
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_comp_strm_free(struct zram_comp_strm *zstrm)
+{
+	if (zstrm->tfm && !IS_ERR(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * crypto_alloc_comp() allocates with GFP_KERNEL, so streams are only
+ * created from process context at device init, never from the I/O path.
+ */
+static struct zram_comp_strm *zram_comp_strm_alloc(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zram_comp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle compression stream, sleeping until another reader or
+ * writer releases one if all are busy.
+ */
+static struct zram_comp_strm *zram_comp_strm_get(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&zram->strm_lock);
+		if (!list_empty(&zram->idle_strm)) {
+			zstrm = list_entry(zram->idle_strm.next,
+					struct zram_comp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&zram->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&zram->strm_lock);
+
+		wait_event(zram->strm_wait, !list_empty(&zram->idle_strm));
+	}
+}
+
+int zram_decompress(struct zram_comp_strm *zstrm, unsigned char *cmem,
+		    unsigned int size, unsigned char *mem)
+{
+	unsigned int clen = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(zstrm->tfm, cmem, size, mem, &clen);
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EIO;
+
+	return ret;
+}
+
+static void zram_comp_strm_put(struct zram *zram,
+			       struct zram_comp_strm *zstrm)
+{
+	spin_lock(&zram->strm_lock);
+	list_add(&zstrm->list, &zram->idle_strm);
+	spin_unlock(&zram->strm_lock);
+
+	wake_up(&zram->strm_wait);
+}
+
+static void zram_comp_strm_destroy_all(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (!list_empty(&zram->idle_strm)) {
+		zstrm = list_entry(zram->idle_strm.next,
+				struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_comp_strm_free(zstrm);
+	}
+	zram->avail_strm = 0;
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
+
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (likely(!element)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+/* zsmalloc handle of a compressed page */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+#ifdef CONFIG_ZRAM_DEDUP
+	return ((struct zram_entry *)zram->table[index].handle)->handle;
+#else
+	return zram->table[index].handle;
+#endif
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -195,39 +307,205 @@ static void setup_swap_header(struct zram *zram, union swap_header *s)
 }
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
+static inline int is_partial_io(struct bio_vec *bvec)
+{
+	return bvec->bv_len != PAGE_SIZE;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Writes incompressible pages back in the background */
+static struct workqueue_struct *zram_wb_wq;
+/* Reads written back pages on behalf of zram_make_request() */
+static struct workqueue_struct *zram_rd_wq;
+
+static unsigned long zram_alloc_bdev_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bitmap_lock);
+	blk = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+	if (blk < zram->nr_pages)
+		__set_bit(blk, zram->bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk;
+}
+
+static void zram_free_bdev_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bitmap_lock);
+	__clear_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously transfer one page to or from the backing device */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_bdev;
+	bio->bi_sector = (sector_t)blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_read {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_read *rd;
+
+	rd = container_of(work, struct zram_bdev_read, work);
+	rd->ret = zram_bdev_rw(rd->zram, rd->page, rd->blk, READ_SYNC);
+}
+
+/*
+ * Read a written back page. Within zram_make_request() bios we submit
+ * are only queued until we return (see generic_make_request()), so
+ * waiting for one here would never finish: do the read from our own
+ * workqueue. Not keventd, which may be the one issuing this I/O, or
+ * have queued work it depends on.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page,
+			  unsigned long blk)
+{
+	struct zram_bdev_read rd = {
+		.zram = zram,
+		.page = page,
+		.blk = blk,
+	};
+
+	INIT_WORK(&rd.work, zram_bdev_read_work);
+	queue_work(zram_rd_wq, &rd.work);
+	flush_work(&rd.work);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return rd.ret;
+}
+
+/* Copy a written back page to mem, or to bvec if mem is NULL */
+static int zram_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			       unsigned long blk, int offset, char *mem)
+{
+	int ret;
+	struct page *page;
+	unsigned char *src, *user_mem;
+
+	if (!mem && !is_partial_io(bvec))
+		return zram_bdev_read(zram, bvec->bv_page, blk);
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read(zram, page, blk);
+	if (!ret) {
+		src = kmap_atomic(page, KM_USER1);
+		if (mem) {
+			memcpy(mem, src, PAGE_SIZE);
+		} else {
+			user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+			memcpy(user_mem + bvec->bv_offset, src + offset,
+			       bvec->bv_len);
+			kunmap_atomic(user_mem, KM_USER0);
+		}
+		kunmap_atomic(src, KM_USER1);
+	}
+	__free_page(page);
+
+	return ret;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+/* Called with the ZRAM_ACCESS bit of the entry held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Any change to the entry voids a pending writeback */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (handle)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].handle = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		clen = 0;
+		zram_free_bdev_block(zram, handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		goto out;
+	}
+#endif
 
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram_get_obj_size(zram, index);
+#ifdef CONFIG_ZRAM_DEDUP
+	if (!zram_dedup_put(zram, (struct zram_entry *)handle)) {
+		/* Object is still used by other pages */
+		zram_stat_dec(&zram->stats.pages_dup);
+		clen = 0;
+		goto out;
+	}
+#else
+	zs_free(zram->mem_pool, handle);
+#endif
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -235,17 +513,17 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -258,7 +536,7 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
 	kunmap_atomic(cmem, KM_USER1);
@@ -267,111 +545,165 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	flush_dcache_page(page);
 }
 
-static inline int is_partial_io(struct bio_vec *bvec)
-{
-	return bvec->bv_len != PAGE_SIZE;
-}
-
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
+	struct zram_comp_strm *zstrm;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	/* The slot lock does not allow sleeping, so get a stream first */
+	zstrm = zram_comp_strm_get(zram);
+	zram_lock_slot(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].handle);
+		ret = 0;
+		goto out;
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
+		handle_same_page(bvec, 0);
+		ret = 0;
+		goto out;
+	}
+
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk = zram->table[index].handle;
+
+		zram_unlock_slot(zram, index);
+		zram_comp_strm_put(zram, zstrm);
+
+		ret = zram_read_from_bdev(zram, bvec, blk, offset, NULL);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+			       "page=%u\n", ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		} else {
+			flush_dcache_page(page);
+		}
+
+		if (is_partial_io(bvec))
+			kfree(uncmem);
+		return ret;
 	}
+#endif
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
-
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
+		ret = 0;
+		goto out;
 	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, zram_get_handle(zram, index),
+			     ZS_MM_RO);
 
-	ret = DECOMPRESS(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		uncmem, &clen);
+	ret = zram_decompress(zstrm, cmem, zram_get_obj_size(zram, index),
+			      uncmem);
 
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, zram_get_handle(zram, index));
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
+		zram_unlock_slot(zram, index);
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+		goto out_free;
 	}
 
 	flush_dcache_page(page);
 
-	return 0;
+out:
+	zram_unlock_slot(zram, index);
+out_free:
+	zram_comp_strm_put(zram, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+	return ret;
 }
 
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	struct zram_comp_strm *zstrm;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
-		memset(mem, 0, PAGE_SIZE);
+	zstrm = zram_comp_strm_get(zram);
+	zram_lock_slot(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
+	    !zram->table[index].handle) {
+		unsigned long element = zram->table[index].handle;
+
+		zram_unlock_slot(zram, index);
+		zram_comp_strm_put(zram, zstrm);
+		zram_fill_page(mem, PAGE_SIZE, element);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk = zram->table[index].handle;
+
+		zram_unlock_slot(zram, index);
+		zram_comp_strm_put(zram, zstrm);
+
+		ret = zram_read_from_bdev(zram, NULL, blk, 0, mem);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+			       "page=%u\n", ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		return ret;
+	}
+#endif
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic((struct page *)zram->table[index].handle,
+				   KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
+		zram_unlock_slot(zram, index);
+		zram_comp_strm_put(zram, zstrm);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, zram_get_handle(zram, index),
+			     ZS_MM_RO);
+	ret = zram_decompress(zstrm, cmem, zram_get_obj_size(zram, index),
+			      mem);
+	zs_unmap_object(zram->mem_pool, zram_get_handle(zram, index));
+	zram_unlock_slot(zram, index);
+	zram_comp_strm_put(zram, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -387,14 +719,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
-	size_t clen;
-	struct zobj_header *zheader;
+	unsigned long handle, element;
+	unsigned int clen;
+	struct zram_comp_strm *zstrm = NULL;
+#ifdef CONFIG_ZRAM_DEDUP
+	u32 checksum;
+	struct zram_entry *entry;
+#endif
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -414,13 +749,9 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	/* May sleep until another writer releases its stream */
+	zstrm = zram_comp_strm_get(zram);
+	src = zstrm->buffer;
 
 	user_mem = kmap_atomic(page, KM_USER0);
 
@@ -430,23 +761,71 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME))
+			zram_free_page(zram, index);
+		zram->table[index].handle = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_unlock_slot(zram, index);
+
+		if (element)
+			zram_stat_inc(&zram->stats.pages_same);
+		else
+			zram_stat_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
+#ifdef CONFIG_ZRAM_DEDUP
+	checksum = zram_dedup_checksum(uncmem);
+	entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+	if (entry) {
+		kunmap_atomic(user_mem, KM_USER0);
+		if (is_partial_io(bvec))
+			kfree(uncmem);
+		zram_comp_strm_put(zram, zstrm);
+
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME))
+			zram_free_page(zram, index);
+		zram->table[index].handle = (unsigned long)entry;
+		zram_set_obj_size(zram, index, entry->len);
+		zram_unlock_slot(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.pages_dup);
+		zram_stat64_inc(zram, &zram->stats.dedup_hits);
+		return 0;
+	}
+#endif
+
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(zstrm->tfm, uncmem, PAGE_SIZE, src, &clen);
+
+	/*
+	 * Page is incompressible. Keep a copy of the original data in
+	 * the stream buffer so it can be stored as-is once the user
+	 * page is unmapped.
+	 */
+	if (unlikely(!ret && clen > max_zpage_size)) {
+		clen = PAGE_SIZE;
+		memcpy(src, uncmem, PAGE_SIZE);
+	}
 
 	kunmap_atomic(user_mem, KM_USER0);
 	if (is_partial_io(bvec))
-			kfree(uncmem);
+		kfree(uncmem);
 
 	if (unlikely(ret != 0)) {
 		pr_err("Compression failed! err=%d\n", ret);
@@ -458,8 +837,7 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 * since we do not want to return too many disk write
 	 * errors which has side effect of hanging the system.
 	 */
-	if (unlikely(clen > max_zpage_size)) {
-		clen = PAGE_SIZE;
+	if (unlikely(clen == PAGE_SIZE)) {
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
 			pr_info("Error allocating memory for "
@@ -468,53 +846,72 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
-	}
-
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
-	}
-
-memstore:
-	zram->table[index].offset = store_offset;
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		handle = (unsigned long)page_store;
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen,
+				   GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!handle)) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%u\n", index, clen);
+			ret = -ENOMEM;
+			goto out;
+		}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+#ifdef CONFIG_ZRAM_DEDUP
+		entry = zram_dedup_add(zram, handle, clen, checksum);
+		if (unlikely(!entry)) {
+			zs_free(zram->mem_pool, handle);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = (unsigned long)entry;
 #endif
+	}
 
-	memcpy(cmem, src, clen);
+	zram_comp_strm_put(zram, zstrm);
+	zstrm = NULL;
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now and publish the new object.
+	 */
+	zram_lock_slot(zram, index);
+	if (zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME))
+		zram_free_page(zram, index);
+
+	zram->table[index].handle = handle;
+	zram_set_obj_size(zram, index, clen);
+	if (unlikely(clen == PAGE_SIZE))
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_slot(zram, index);
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
+	if (clen == PAGE_SIZE)
+		zram_stat_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Batch incompressible pages for writeback to the backing device */
+	if (unlikely(clen == PAGE_SIZE) && zram->backing_bdev)
+		queue_delayed_work(zram_wb_wq, &zram->wb_work, HZ);
+#endif
+
 	return 0;
 
 out:
+	if (zstrm)
+		zram_comp_strm_put(zram, zstrm);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -525,15 +922,10 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -640,42 +1032,284 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Write one entry to the backing device if it matches mode. The entry
+ * is copied out under the slot lock; it is replaced by the backing
+ * block only if nobody changed it while the write was in flight.
+ */
+static int zram_writeback_slot(struct zram *zram, u32 index,
+			       enum zram_wb_mode mode, struct page *page)
+{
+	int ret = 0;
+	unsigned long blk;
+	struct zram_comp_strm *zstrm;
+	unsigned char *cmem, *mem;
+
+	zstrm = zram_comp_strm_get(zram);
+	zram_lock_slot(zram, index);
+
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    (mode == ZRAM_WB_HUGE &&
+	     !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) ||
+	    (mode == ZRAM_WB_IDLE &&
+	     !zram_test_flag(zram, index, ZRAM_IDLE))) {
+		zram_unlock_slot(zram, index);
+		zram_comp_strm_put(zram, zstrm);
+		return 0;
+	}
+
+	mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic((struct page *)zram->table[index].handle,
+				   KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		cmem = zs_map_object(zram->mem_pool,
+				     zram_get_handle(zram, index), ZS_MM_RO);
+		ret = zram_decompress(zstrm, cmem,
+				      zram_get_obj_size(zram, index), mem);
+		zs_unmap_object(zram->mem_pool, zram_get_handle(zram, index));
+	}
+	kunmap_atomic(mem, KM_USER0);
+
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	zram_unlock_slot(zram, index);
+	zram_comp_strm_put(zram, zstrm);
+
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		return ret;
+	}
+
+	blk = zram_alloc_bdev_block(zram);
+	if (!blk) {
+		ret = -ENOSPC;
+		goto out_clear;
+	}
+
+	ret = zram_bdev_rw(zram, page, blk, WRITE_SYNC);
+	if (ret) {
+		pr_err("Backing device write failed! err=%d, page=%u\n",
+		       ret, index);
+		zram_free_bdev_block(zram, blk);
+		goto out_clear;
+	}
+
+	zram_lock_slot(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		/* Entry was freed or overwritten meanwhile */
+		zram_unlock_slot(zram, index);
+		zram_free_bdev_block(zram, blk);
+		return 0;
+	}
+
+	zram_free_page(zram, index);
+	zram->table[index].handle = blk;
+	zram_set_flag(zram, index, ZRAM_WB);
+	zram_unlock_slot(zram, index);
+
+	/* zram_free_page() dropped it, but the page is still stored */
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.bd_count);
+	zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+	return 0;
+
+out_clear:
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_unlock_slot(zram, index);
+	return ret;
+}
+
+/**
+ * zram_writeback - write pages matching mode to the backing device
+ * @zram: device to write back from
+ * @mode: ZRAM_WB_HUGE or ZRAM_WB_IDLE
+ *
+ * Returns 0 on success, -ENOSPC if the backing device filled up.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	size_t index;
+	struct page *page;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->backing_bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		ret = zram_writeback_slot(zram, index, mode, page);
+		if (ret == -ENOSPC)
+			break;
+		ret = 0;
+		cond_resched();
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+	__free_page(page);
+	return ret;
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work.work);
+
+	zram_writeback(zram, ZRAM_WB_HUGE);
+}
+
+/* Mark all stored pages idle; accessing a page clears the mark */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
+/* Called with init_lock held, before the device is initialized */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *backing_path;
+	unsigned long nr_pages, *bitmap;
+	struct block_device *bdev;
+
+	backing_path = kstrdup(path, GFP_KERNEL);
+	if (!backing_path)
+		return -ENOMEM;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out_free_path;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	bitmap = vmalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+	memset(bitmap, 0, BITS_TO_LONGS(nr_pages) * sizeof(long));
+	/* Block 0 is reserved, see struct zram */
+	__set_bit(0, bitmap);
+
+	zram_reset_backing_dev(zram);
+	zram->backing_bdev = bdev;
+	zram->backing_path = backing_path;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+
+	pr_info("Using %s (%lu pages) as backing device\n", path, nr_pages);
+
+	return 0;
+
+out_close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out_free_path:
+	kfree(backing_path);
+	return ret;
+}
+
+/* Called with init_lock held, when no page is on the backing device */
+void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_bdev)
+		return;
+
+	close_bdev_exclusive(zram->backing_bdev, FMODE_READ | FMODE_WRITE);
+	zram->backing_bdev = NULL;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+
+	kfree(zram->backing_path);
+	zram->backing_path = NULL;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+#endif
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_comp_strm_destroy_all(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+#ifdef CONFIG_ZRAM_DEDUP
+			zram_dedup_put(zram, (struct zram_entry *)handle);
+#else
+			zs_free(zram->mem_pool, handle);
+#endif
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
-	zram->mem_pool = NULL;
+#ifdef CONFIG_ZRAM_DEDUP
+	zram_dedup_fini(zram);
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Written back pages went with the table */
+	zram_reset_backing_dev(zram);
+#endif
+
+	/* the pool is created last: init failures get here without one */
+	if (zram->mem_pool) {
+		zs_destroy_pool(zram->mem_pool);
+		zram->mem_pool = NULL;
+	}
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
@@ -688,6 +1322,7 @@ int zram_init_device(struct zram *zram)
 {
 	int ret;
 	size_t num_pages;
+	struct zram_comp_strm *zstrm;
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	struct page *page;
 	union swap_header *swap_header;
@@ -702,16 +1337,18 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
+	if (!zram->max_strm)
+		zram->max_strm = num_online_cpus();
+	while (zram->avail_strm < zram->max_strm) {
+		zstrm = zram_comp_strm_alloc(zram);
+		if (!zstrm)
+			break;
+		list_add(&zstrm->list, &zram->idle_strm);
+		zram->avail_strm++;
 	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	if (!zram->avail_strm) {
+		pr_err("Error allocating %s compression stream!\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -726,6 +1363,14 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+#ifdef CONFIG_ZRAM_DEDUP
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret) {
+		pr_err("Error allocating dedup hash table\n");
+		goto fail;
+	}
+#endif
+
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
@@ -733,7 +1378,7 @@ int zram_init_device(struct zram *zram)
 		ret = -ENOMEM;
 		goto fail;
 	}
-	zram->table[0].page = page;
+	zram->table[0].handle = (unsigned long)page;
 	zram_set_flag(zram, 0, ZRAM_UNCOMPRESSED);
 	swap_header = kmap(page);
 	setup_swap_header(zram, swap_header);
@@ -744,7 +1389,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -770,7 +1415,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -783,9 +1430,17 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->strm_lock);
+	INIT_LIST_HEAD(&zram->idle_strm);
+	init_waitqueue_head(&zram->strm_wait);
+	strlcpy(zram->compressor, ZRAM_DEFAULT_COMPRESSOR,
+		sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -868,11 +1523,25 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_wb_wq = create_singlethread_workqueue("zram_wb");
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	zram_rd_wq = create_workqueue("zram_rd");
+	if (!zram_rd_wq) {
+		destroy_workqueue(zram_wb_wq);
+		ret = -ENOMEM;
+		goto out;
+	}
+#endif
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto out_wq;
 	}
 
 	if (!zram_num_devices) {
@@ -902,6 +1571,11 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+out_wq:
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_rd_wq);
+	destroy_workqueue(zram_wb_wq);
+#endif
 out:
 	return ret;
 }
@@ -917,9 +1591,16 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_reset_backing_dev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_rd_wq);
+	destroy_workqueue(zram_wb_wq);
+#endif
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
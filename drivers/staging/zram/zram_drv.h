@@ -17,8 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/crypto.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,8 +43,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -66,27 +58,81 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * table[page_no].value packs the compressed object size in the lower
+ * ZRAM_FLAG_SHIFT bits; page flags are stored above it.
+ */
+#define ZRAM_FLAG_SHIFT		16
+#define ZRAM_SIZE_MASK		((1UL << ZRAM_FLAG_SHIFT) - 1)
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
+	ZRAM_UNCOMPRESSED = ZRAM_FLAG_SHIFT,
+
+	/*
+	 * Page consists of a single repeated word, kept in handle
+	 * instead of allocating memory (0 for zero filled pages)
+	 */
+	ZRAM_SAME,
+
+	/* Bit spinlock serializing access to this table entry */
+	ZRAM_ACCESS,
+
+	/* Page lives on the backing device; handle is its block index */
+	ZRAM_WB,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is being written back; cleared if the entry changes */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since the last "idle" marking */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. handle is a zsmalloc handle, or the
+ * struct page of a page stored uncompressed.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	unsigned long handle;
+	unsigned long value;	/* object size and zram_pageflags */
 } __attribute__((aligned(4)));
 
+/*
+ * Compression stream: crypto transform and output buffer for one
+ * in-flight (de)compression. Streams are kept on zram->idle_strm and
+ * handed out to readers and writers, so concurrent I/O does not
+ * serialize on a single buffer.
+ */
+struct zram_comp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;		/* 2 pages: compressed output may expand */
+	struct list_head list;
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+/*
+ * Compressed object shared by all pages with the same content. With
+ * dedup, table[page_no].handle of a compressed page points to one.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* on zram->hash[checksum & mask] */
+	u32 checksum;		/* of the uncompressed page */
+	unsigned int len;	/* compressed size */
+	unsigned long handle;	/* zsmalloc handle of the object */
+	int refcount;		/* protected by the bucket lock */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+#endif
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,20 +141,35 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of other single word filled pages */
+#ifdef CONFIG_ZRAM_DEDUP
+	atomic_t pages_dup;	/* no. of pages sharing another's object */
+	u64 dedup_hits;		/* no. of writes satisfied by dedup */
+#endif
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic_t bd_count;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* no. of reads from the backing device */
+	u64 bd_writes;		/* no. of pages written back */
+#endif
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+
+	/* Compression streams; see zram_comp_strm_get() */
+	spinlock_t strm_lock;	/* protect idle_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* no. of streams allocated */
+	int max_strm;		/* no. of streams to allocate at init */
+	char compressor[CRYPTO_MAX_ALG_NAME];	/* crypto_comp algorithm */
+
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -120,9 +181,35 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 
+#ifdef CONFIG_ZRAM_DEDUP
+	struct zram_hash *hash;	/* buckets of zram_entry, by checksum */
+	unsigned long hash_mask;
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/*
+	 * Backing device for pages written back from memory. Its space
+	 * is handed out in PAGE_SIZE blocks tracked by bitmap; block 0
+	 * is never used so that a handle of 0 still means "no page".
+	 */
+	struct block_device *backing_bdev;
+	char *backing_path;
+	unsigned long *bitmap;
+	unsigned long nr_pages;	/* size of the backing device, in pages */
+	spinlock_t bitmap_lock;
+	struct delayed_work wb_work;	/* writes back incompressible pages */
+#endif
+
 	struct zram_stats stats;
 };
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* pages stored uncompressed */
+	ZRAM_WB_IDLE,		/* pages marked idle */
+};
+#endif
+
 extern struct zram *zram_devices;
 extern unsigned int zram_num_devices;
 #ifdef CONFIG_SYSFS
@@ -131,5 +218,24 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_decompress(struct zram_comp_strm *zstrm, unsigned char *cmem,
+			   unsigned int size, unsigned char *mem);
+#ifdef CONFIG_ZRAM_DEDUP
+extern int zram_dedup_init(struct zram *zram, size_t num_pages);
+extern void zram_dedup_fini(struct zram *zram);
+extern u32 zram_dedup_checksum(unsigned char *mem);
+extern struct zram_entry *zram_dedup_find(struct zram *zram,
+			struct zram_comp_strm *zstrm, unsigned char *mem,
+			u32 checksum);
+extern struct zram_entry *zram_dedup_add(struct zram *zram,
+			unsigned long handle, unsigned int len, u32 checksum);
+extern int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_backing_dev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
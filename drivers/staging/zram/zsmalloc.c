@@ -0,0 +1,753 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Size-class allocator for compressed pages. Objects of a class are
+ * carved out of a "zspage" of one to ZS_MAX_PAGES_PER_ZSPAGE physical
+ * pages and are addressed through handles, so they can be moved by
+ * zs_compact() to give back pages fragmented by frees.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/*
+ * Objects straddling a page boundary are mapped by copying them to a
+ * per-cpu buffer; zs_unmap_object() copies them back unless mapped
+ * read-only.
+ */
+struct mapping_area {
+	char *vm_buf;
+	char *vm_addr;		/* kmap_atomic() address, NULL if copied */
+	enum zs_mapmode vm_mm;
+};
+
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static struct kmem_cache *zs_handle_cachep;
+static struct kmem_cache *zs_zspage_cachep;
+
+/* Pools the shrinker compacts under memory pressure */
+static LIST_HEAD(zs_pools);
+static DEFINE_MUTEX(zs_pools_lock);
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+					ZS_SIZE_CLASS_DELTA);
+	return 0;
+}
+
+/*
+ * Pick the zspage size (in pages) that wastes the least space at the
+ * end of the zspage for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % size;
+		unsigned int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+/* Keeps the pin bit, so it can be used on a pinned handle */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	unsigned long *word = (unsigned long *)handle;
+
+	*word = obj | (*word & (1UL << HANDLE_PIN_BIT));
+}
+
+static unsigned long location_to_obj(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long obj;
+
+	obj = page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS;
+	obj |= idx & OBJ_INDEX_MASK;
+
+	return obj << (HANDLE_PIN_BIT + 1);
+}
+
+static void obj_to_location(unsigned long obj, struct zspage **zspage,
+				unsigned int *idx)
+{
+	obj >>= HANDLE_PIN_BIT + 1;
+	*zspage = (struct zspage *)page_private(
+				pfn_to_page(obj >> OBJ_INDEX_BITS));
+	*idx = obj & OBJ_INDEX_MASK;
+}
+
+/*
+ * Object headers are word aligned and class sizes are multiples of
+ * the word size, so a header never straddles a page boundary.
+ */
+static unsigned long *obj_header_map(struct size_class *class,
+			struct zspage *zspage, unsigned int idx)
+{
+	unsigned long offset = (unsigned long)idx * class->size;
+	unsigned char *base;
+
+	base = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT], KM_USER0);
+	return (unsigned long *)(base + (offset & ~PAGE_MASK));
+}
+
+static void obj_header_unmap(unsigned long *link)
+{
+	kunmap_atomic(link, KM_USER0);
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	if (zspage->inuse == 0)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * 4 <= class->objs_per_zspage * 3)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Move zspage to the list matching its fullness. Empty zspages, and
+ * zspages isolated by compaction, are kept off the lists.
+ */
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return;
+
+	list_del_init(&zspage->list);
+	zspage->fullness = newfg;
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+}
+
+/* Prefer fuller zspages so that sparse ones can drain */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					struct zspage, list);
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					struct zspage, list);
+	return NULL;
+}
+
+static struct zspage *alloc_zspage(struct size_class *class,
+			unsigned int class_idx, gfp_t flags)
+{
+	unsigned int i;
+	unsigned long *link;
+	struct zspage *zspage;
+
+	zspage = kmem_cache_zalloc(zs_zspage_cachep, flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (!page)
+			goto out_free;
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	/* Link all objects into the freelist */
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		link = obj_header_map(class, zspage, i);
+		if (i + 1 < class->objs_per_zspage)
+			*link = (unsigned long)(i + 2) << OBJ_TAG_BITS;
+		else
+			*link = 0;
+		obj_header_unmap(link);
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class_idx = class_idx;
+	zspage->freeobj = 1;
+	zspage->fullness = ZS_EMPTY;
+
+	return zspage;
+
+out_free:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zs_zspage_cachep, zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zs_zspage_cachep, zspage);
+	atomic_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/* Called with class->lock held */
+static unsigned int obj_malloc(struct size_class *class,
+			struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx = zspage->freeobj - 1;
+	unsigned long *link;
+
+	link = obj_header_map(class, zspage, idx);
+	zspage->freeobj = *link >> OBJ_TAG_BITS;
+	*link = handle | OBJ_ALLOCATED_TAG;
+	obj_header_unmap(link);
+
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return idx;
+}
+
+/* Called with class->lock held */
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	unsigned long *link;
+
+	link = obj_header_map(class, zspage, idx);
+	*link = (unsigned long)zspage->freeobj << OBJ_TAG_BITS;
+	obj_header_unmap(link);
+
+	zspage->freeobj = idx + 1;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/*
+ * Copy the payload (everything after the header) of an object to or
+ * from buf, one page at a time.
+ */
+static void copy_object(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, char *buf, int to_zspage)
+{
+	unsigned long offset = (unsigned long)idx * class->size + ZS_HANDLE_SIZE;
+	unsigned int len = class->size - ZS_HANDLE_SIZE;
+
+	buf += ZS_HANDLE_SIZE;
+	while (len) {
+		unsigned int off = offset & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - off);
+		unsigned char *base;
+
+		base = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+					KM_USER1);
+		if (to_zspage)
+			memcpy(base + off, buf, n);
+		else
+			memcpy(buf, base + off, n);
+		kunmap_atomic(base, KM_USER1);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+/* Copy the payload of an object between two zspages of a class */
+static void move_object(struct size_class *class, struct zspage *src,
+			unsigned int sidx, struct zspage *dst, unsigned int didx)
+{
+	unsigned long soff = (unsigned long)sidx * class->size + ZS_HANDLE_SIZE;
+	unsigned long doff = (unsigned long)didx * class->size + ZS_HANDLE_SIZE;
+	unsigned int len = class->size - ZS_HANDLE_SIZE;
+
+	while (len) {
+		unsigned int so = soff & ~PAGE_MASK;
+		unsigned int dof = doff & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len,
+					PAGE_SIZE - max(so, dof));
+		unsigned char *s, *d;
+
+		s = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		d = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(d + dof, s + so, n);
+		kunmap_atomic(d, KM_USER1);
+		kunmap_atomic(s, KM_USER0);
+
+		soff += n;
+		doff += n;
+		len -= n;
+	}
+}
+
+/**
+ * zs_create_pool - Create a memory pool.
+ * @name: name of the pool, for debugging
+ *
+ * Returns the pool on success, NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	unsigned int i, j;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / class->size;
+		for (j = 0; j < __NR_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+	}
+
+	pool->name = name;
+
+	mutex_lock(&zs_pools_lock);
+	list_add(&pool->list, &zs_pools);
+	mutex_unlock(&zs_pools_lock);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	unsigned int i, j;
+	struct zspage *zspage, *tmp;
+
+	mutex_lock(&zs_pools_lock);
+	list_del(&pool->list);
+	mutex_unlock(&zs_pools_lock);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->objs_inuse)
+			pr_warning("%s: class %u (size %u) has %lu objects "
+				"left\n", pool->name, i, class->size,
+				class->objs_inuse);
+
+		for (j = 0; j < __NR_FULLNESS_GROUPS; j++)
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[j], list)
+				free_zspage(pool, class, zspage);
+	}
+
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: gfp flags used when the pool has to grow
+ *
+ * On success, returns an opaque handle to the object, which must be
+ * mapped with zs_map_object() to be accessed. On failure, returns 0.
+ *
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned int class_idx, idx;
+	unsigned long handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size <= ZS_HANDLE_SIZE || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+						flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, class_idx, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cachep, (void *)handle);
+			return 0;
+		}
+		atomic_add(class->pages_per_zspage, &pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		class->objs_allocated += class->objs_per_zspage;
+	}
+
+	idx = obj_malloc(class, zspage, handle);
+	fix_fullness_group(class, zspage);
+	*(unsigned long *)handle = location_to_obj(zspage, idx);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Keep compaction from moving the object under us */
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = &pool->size_class[zspage->class_idx];
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, idx);
+	fix_fullness_group(class, zspage);
+	if (zspage->fullness == ZS_EMPTY)
+		class->objs_allocated -= class->objs_per_zspage;
+	else
+		zspage = NULL;
+	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	if (zspage)
+		free_zspage(pool, class, zspage);
+
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: access the mapping will be used for
+ *
+ * The object is pinned, so compaction cannot move it, until the
+ * matching zs_unmap_object(). Mappings use KM_USER1 and disable
+ * preemption; only one object can be mapped at a time per cpu.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned int idx;
+	unsigned long offset;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = &pool->size_class[zspage->class_idx];
+	offset = (unsigned long)idx * class->size;
+
+	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if ((offset & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->vm_addr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+						KM_USER1);
+		return area->vm_addr + (offset & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* Object straddles two pages */
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		copy_object(class, zspage, idx, area->vm_buf, 0);
+
+	return area->vm_buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER1);
+	} else if (area->vm_mm != ZS_MM_RO) {
+		obj_to_location(handle_to_obj(handle), &zspage, &idx);
+		copy_object(&pool->size_class[zspage->class_idx], zspage, idx,
+				area->vm_buf, 1);
+	}
+	put_cpu_var(zs_map_area);
+
+	unpin_tag(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Move the objects of isolated zspage src into other zspages of its
+ * class. Stops at the first object that is pinned or when the class
+ * has no room left. Called with class->lock held.
+ */
+static void migrate_zspage(struct size_class *class, struct zspage *src)
+{
+	unsigned int idx, didx;
+	unsigned long handle, head, *link;
+	struct zspage *dst;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		link = obj_header_map(class, src, idx);
+		head = *link;
+		obj_header_unmap(link);
+
+		if (!(head & OBJ_ALLOCATED_TAG))
+			continue;
+
+		dst = find_get_zspage(class);
+		if (!dst)
+			return;
+
+		handle = head & ~OBJ_ALLOCATED_TAG;
+		if (!trypin_tag(handle))
+			return;
+
+		didx = obj_malloc(class, dst, handle);
+		move_object(class, src, idx, dst, didx);
+		record_obj(handle, location_to_obj(dst, didx));
+		obj_free(class, src, idx);
+		fix_fullness_group(class, dst);
+
+		unpin_tag(handle);
+	}
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+			struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct zspage *src;
+
+	spin_lock(&class->lock);
+	while (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY])) {
+		src = list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					struct zspage, list);
+
+		/* Isolate src so it is not picked as destination */
+		list_del_init(&src->list);
+		src->fullness = ZS_EMPTY;
+
+		migrate_zspage(class, src);
+
+		if (src->inuse) {
+			fix_fullness_group(class, src);
+			break;
+		}
+
+		class->objs_allocated -= class->objs_per_zspage;
+		spin_unlock(&class->lock);
+
+		free_zspage(pool, class, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects to free sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += compact_class(pool, &pool->size_class[i]);
+
+	atomic_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/* Pages compaction could free, judging by the unused object slots */
+static unsigned long zs_can_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long unused;
+
+		unused = class->objs_allocated - class->objs_inuse;
+		pages += unused / class->objs_per_zspage *
+				class->pages_per_zspage;
+	}
+
+	return pages;
+}
+
+static int zs_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct zs_pool *pool;
+	unsigned long freed = 0;
+	int count = 0;
+
+	/* A pool may be created or destroyed from reclaim context */
+	if (!mutex_trylock(&zs_pools_lock))
+		return nr_to_scan ? -1 : 0;
+
+	list_for_each_entry(pool, &zs_pools, list) {
+		if (nr_to_scan && freed < nr_to_scan)
+			freed += zs_compact(pool);
+		count += zs_can_compact(pool);
+	}
+
+	mutex_unlock(&zs_pools_lock);
+
+	return count;
+}
+
+static struct shrinker zs_shrinker = {
+	.shrink = zs_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/* Size of the allocated objects, including headers and class rounding */
+u64 zs_get_used_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 used = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		used += (u64)pool->size_class[i].objs_inuse *
+				pool->size_class[i].size;
+
+	return used;
+}
+EXPORT_SYMBOL_GPL(zs_get_used_size_bytes);
+
+u64 zs_get_compacted_pages(struct zs_pool *pool)
+{
+	return atomic_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_compacted_pages);
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(unsigned long), 0, 0, NULL);
+	if (!zs_handle_cachep)
+		goto out;
+
+	zs_zspage_cachep = kmem_cache_create("zs_zspage",
+				sizeof(struct zspage), 0, 0, NULL);
+	if (!zs_zspage_cachep)
+		goto out_free_handle;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(zs_map_area, cpu).vm_buf =
+				kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!per_cpu(zs_map_area, cpu).vm_buf)
+			goto out_free_buf;
+	}
+
+	register_shrinker(&zs_shrinker);
+
+	return 0;
+
+out_free_buf:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(zs_map_area, cpu).vm_buf);
+	kmem_cache_destroy(zs_zspage_cachep);
+out_free_handle:
+	kmem_cache_destroy(zs_handle_cachep);
+out:
+	pr_err("zsmalloc: failed to initialize\n");
+	return -ENOMEM;
+}
+
+module_init(zs_init);
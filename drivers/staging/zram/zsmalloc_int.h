@@ -0,0 +1,99 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * Objects are carved out of a "zspage" of 1 to ZS_MAX_PAGES_PER_ZSPAGE
+ * physical pages, so objects of a size class that does not divide
+ * PAGE_SIZE can straddle page boundaries instead of wasting the tail
+ * of every page.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes. It must be
+ * a multiple of sizeof(unsigned long) so that object headers never
+ * straddle a page boundary (16 bytes with 4K pages).
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/* End of user params */
+
+/*
+ * Every object starts with a header word: the handle of an allocated
+ * object with OBJ_ALLOCATED_TAG set, or the index + 1 of the next free
+ * object (0 for none) shifted by OBJ_TAG_BITS. Storing the handle lets
+ * compaction find and update the owner of an object it moves.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1UL
+
+/*
+ * A handle points to a word holding the object location:
+ * <PFN of first zspage page, object index> above HANDLE_PIN_BIT, a bit
+ * spinlock that keeps the object in place while it is mapped or freed.
+ */
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS		(PAGE_SHIFT + ilog2(ZS_MAX_PAGES_PER_ZSPAGE) \
+					- ilog2(ZS_MIN_ALLOC_SIZE))
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,	/* at most 3/4 of the objects in use */
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	__NR_FULLNESS_GROUPS,
+};
+
+struct zspage {
+	struct list_head list;	/* on size_class->fullness_list */
+	unsigned int class_idx;
+	unsigned int inuse;	/* no. of objects allocated */
+	unsigned int freeobj;	/* index + 1 of first free object */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;	/* protect lists, zspages and objects */
+	unsigned int size;	/* object size including header */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	struct list_head fullness_list[__NR_FULLNESS_GROUPS];
+
+	/* stats */
+	unsigned long objs_allocated;	/* object slots in zspages */
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	atomic_t pages_allocated;
+	atomic_t pages_compacted;
+	struct list_head list;	/* on zs_pools, for the shrinker */
+	const char *name;
+};
+
+#endif
@@ -27,7 +27,10 @@
  *
  * This file implements a generic cache implementation used for both caches,
  * plus functions layered ontop of the generic cache implementation to
- * access the metadata and fragment caches.
+ * access the metadata and fragment caches.  Entries are found through a
+ * hash on the block, and the least recently released unused entry is the
+ * one evicted.  The number of entries in each cache can be set with the
+ * metadata_cache=, fragment_cache= and data_cache= mount options.
  *
  * To avoid out of memory and fragmentation isssues with vmalloc the cache
  * uses sequences of kmalloced PAGE_CACHE_SIZE buffers.
@@ -53,12 +56,35 @@
 #include <linux/wait.h>
 #include <linux/zlib.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
 
+static struct hlist_head *cache_bucket(struct squashfs_cache *cache,
+	u64 block)
+{
+	return &cache->hash[hash_64(block, cache->hash_bits)];
+}
+
+
+static struct squashfs_cache_entry *cache_lookup(struct squashfs_cache *cache,
+	u64 block)
+{
+	struct squashfs_cache_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos, cache_bucket(cache, block), hash)
+		if (entry->block == block)
+			return entry;
+
+	return NULL;
+}
+
+
 /*
  * Look-up block in cache, and increment usage count.  If not in cache, read
  * and decompress it from disk.
@@ -66,22 +92,19 @@
 struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 	struct squashfs_cache *cache, u64 block, int length)
 {
-	int i, n;
 	struct squashfs_cache_entry *entry;
 
 	spin_lock(&cache->lock);
 
 	while (1) {
-		for (i = 0; i < cache->entries; i++)
-			if (cache->entry[i].block == block)
-				break;
+		entry = cache_lookup(cache, block);
 
-		if (i == cache->entries) {
+		if (entry == NULL) {
 			/*
 			 * Block not in cache, if all cache entries are used
 			 * go to sleep waiting for one to become available.
 			 */
-			if (cache->unused == 0) {
+			if (list_empty(&cache->lru)) {
 				cache->num_waiters++;
 				spin_unlock(&cache->lock);
 				wait_event(cache->wait_queue, cache->unused);
@@ -91,19 +114,14 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			}
 
 			/*
-			 * At least one unused cache entry.  A simple
-			 * round-robin strategy is used to choose the entry to
-			 * be evicted from the cache.
+			 * At least one unused cache entry.  Evict the one
+			 * released least recently.
 			 */
-			i = cache->next_blk;
-			for (n = 0; n < cache->entries; n++) {
-				if (cache->entry[i].refcount == 0)
-					break;
-				i = (i + 1) % cache->entries;
-			}
-
-			cache->next_blk = (i + 1) % cache->entries;
-			entry = &cache->entry[i];
+			entry = list_entry(cache->lru.next,
+				struct squashfs_cache_entry, lru);
+			list_del_init(&entry->lru);
+			if (!hlist_unhashed(&entry->hash))
+				hlist_del(&entry->hash);
 
 			/*
 			 * Initialise choosen cache entry, and fill it in from
@@ -111,6 +129,7 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			 */
 			cache->unused--;
 			entry->block = block;
+			hlist_add_head(&entry->hash, cache_bucket(cache, block));
 			entry->refcount = 1;
 			entry->pending = 1;
 			entry->num_waiters = 0;
@@ -148,9 +167,10 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 		 * previously unused there's one less cache entry available
 		 * for reuse.
 		 */
-		entry = &cache->entry[i];
-		if (entry->refcount == 0)
+		if (entry->refcount == 0) {
 			cache->unused--;
+			list_del_init(&entry->lru);
+		}
 		entry->refcount++;
 
 		/*
@@ -169,7 +189,8 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 
 out:
 	TRACE("Got %s %d, start block %lld, refcount %d, error %d\n",
-		cache->name, i, entry->block, entry->refcount, entry->error);
+		cache->name, (int) (entry - cache->entry), entry->block,
+		entry->refcount, entry->error);
 
 	if (entry->error)
 		ERROR("Unable to read %s cache entry [%llx]\n", cache->name,
@@ -179,7 +200,10 @@ out:
 
 
 /*
- * Release cache entry, once usage count is zero it can be reused.
+ * Release cache entry, once usage count is zero it can be reused.  Unused
+ * entries are kept in least recently released order for eviction; entries
+ * that failed to read are dropped from the hash and reused first, so the
+ * next access retries the read.
  */
 void squashfs_cache_put(struct squashfs_cache_entry *entry)
 {
@@ -189,6 +213,12 @@ void squashfs_cache_put(struct squashfs_cache_entry *entry)
 	entry->refcount--;
 	if (entry->refcount == 0) {
 		cache->unused++;
+		if (entry->error) {
+			hlist_del_init(&entry->hash);
+			entry->block = SQUASHFS_INVALID_BLK;
+			list_add(&entry->lru, &cache->lru);
+		} else
+			list_add_tail(&entry->lru, &cache->lru);
 		/*
 		 * If there's any processes waiting for a block to become
 		 * available, wake one up.
@@ -212,14 +242,17 @@ void squashfs_cache_delete(struct squashfs_cache *cache)
 	if (cache == NULL)
 		return;
 
-	for (i = 0; i < cache->entries; i++) {
-		if (cache->entry[i].data) {
-			for (j = 0; j < cache->pages; j++)
-				kfree(cache->entry[i].data[j]);
-			kfree(cache->entry[i].data);
+	if (cache->entry) {
+		for (i = 0; i < cache->entries; i++) {
+			if (cache->entry[i].data) {
+				for (j = 0; j < cache->pages; j++)
+					kfree(cache->entry[i].data[j]);
+				kfree(cache->entry[i].data);
+			}
 		}
 	}
 
+	kfree(cache->hash);
 	kfree(cache->entry);
 	kfree(cache);
 }
@@ -229,6 +262,7 @@ void squashfs_cache_delete(struct squashfs_cache *cache)
  * Initialise cache allocating the specified number of entries, each of
  * size block_size.  To avoid vmalloc fragmentation issues each entry
  * is allocated as a sequence of kmalloced PAGE_CACHE_SIZE buffers.
+ * Lookups go through a hash of about one bucket per entry.
  */
 struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 	int block_size)
@@ -247,7 +281,14 @@ struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 		goto cleanup;
 	}
 
-	cache->next_blk = 0;
+	cache->hash_bits = max(ilog2(roundup_pow_of_two(entries)), 1);
+	cache->hash = kcalloc(1 << cache->hash_bits, sizeof(*cache->hash),
+		GFP_KERNEL);
+	if (cache->hash == NULL) {
+		ERROR("Failed to allocate %s cache\n", name);
+		goto cleanup;
+	}
+
 	cache->unused = entries;
 	cache->entries = entries;
 	cache->block_size = block_size;
@@ -257,6 +298,7 @@ struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 	cache->num_waiters = 0;
 	spin_lock_init(&cache->lock);
 	init_waitqueue_head(&cache->wait_queue);
+	INIT_LIST_HEAD(&cache->lru);
 
 	for (i = 0; i < entries; i++) {
 		struct squashfs_cache_entry *entry = &cache->entry[i];
@@ -264,6 +306,8 @@ struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 		init_waitqueue_head(&cache->entry[i].wait_queue);
 		entry->cache = cache;
 		entry->block = SQUASHFS_INVALID_BLK;
+		INIT_HLIST_NODE(&entry->hash);
+		list_add_tail(&entry->lru, &cache->lru);
 		entry->data = kcalloc(cache->pages, sizeof(void *), GFP_KERNEL);
 		if (entry->data == NULL) {
 			ERROR("Failed to allocate %s cache entry\n", name);
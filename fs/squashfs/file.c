@@ -372,11 +372,87 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Decompress a whole datablock straight into the page cache, skipping the
+ * copy through the read_page cache entry.  This needs every page covered by
+ * the block; if one cannot be grabbed or is already up to date, -EAGAIN is
+ * returned and the caller falls back to the cache.  On -EAGAIN and on error
+ * the target page is left locked and untouched.
+ */
+static int squashfs_readpage_direct(struct page *target, u64 block, int bsize,
+	int expected)
+{
+	struct inode *inode = target->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target->index & ~mask;
+	int pages = (expected + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	struct page **page;
+	void **pageaddr;
+	int i, avail, res = -EAGAIN;
+
+	page = kmalloc(pages * sizeof(*page), GFP_KERNEL);
+	pageaddr = kmalloc(pages * sizeof(*pageaddr), GFP_KERNEL);
+	if (page == NULL || pageaddr == NULL)
+		goto out;
+
+	for (i = 0; i < pages; i++) {
+		page[i] = (start_index + i == target->index) ? target :
+			grab_cache_page_nowait(target->mapping, start_index + i);
+
+		if (page[i] == NULL || (page[i] != target &&
+						PageUptodate(page[i]))) {
+			if (page[i])
+				i++;
+			res = -EAGAIN;
+			goto release_pages;
+		}
+	}
+
+	for (i = 0; i < pages; i++)
+		pageaddr[i] = kmap(page[i]);
+
+	res = squashfs_read_data(inode->i_sb, pageaddr, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+
+	/* a short block means corruption, don't hand out partial pages */
+	avail = res - ((pages - 1) << PAGE_CACHE_SHIFT);
+	if (res >= 0 && avail <= 0)
+		res = -EIO;
+	if (res >= 0)
+		memset(pageaddr[pages - 1] + avail, 0, PAGE_CACHE_SIZE - avail);
+
+	for (i = 0; i < pages; i++) {
+		kunmap(page[i]);
+		flush_dcache_page(page[i]);
+		if (res >= 0)
+			SetPageUptodate(page[i]);
+	}
+
+	if (res >= 0)
+		unlock_page(target);
+	i = pages;
+
+release_pages:
+	while (i--) {
+		if (page[i] == target)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+
+out:
+	kfree(pageaddr);
+	kfree(page);
+	return res < 0 ? res : 0;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
+	int bytes, i, res, offset = 0, sparse = 0;
 	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
 
@@ -404,15 +480,24 @@ static int squashfs_readpage(struct file *file, struct page *page)
 		if (bsize < 0)
 			goto error_out;
 
-		if (bsize == 0) { /* hole */
-			bytes = index == file_end ?
-				(i_size_read(inode) & (msblk->block_size - 1)) :
-				 msblk->block_size;
+		bytes = index == file_end ?
+			(i_size_read(inode) & (msblk->block_size - 1)) :
+			 msblk->block_size;
+
+		if (bsize == 0) /* hole */
 			sparse = 1;
-		} else {
+		else {
 			/*
-			 * Read and decompress datablock.
+			 * Read and decompress datablock, straight into the
+			 * page cache if we can.
 			 */
+			res = squashfs_readpage_direct(page, block, bsize,
+				bytes);
+			if (res == 0)
+				return 0;
+			if (res != -EAGAIN)
+				goto error_out;
+
 			buffer = squashfs_get_datablock(inode->i_sb,
 								block, bsize);
 			if (buffer->error) {
@@ -497,6 +582,52 @@ out:
 }
 
 
+/*
+ * Readahead.  Every datablock is decompressed once: the pages of the
+ * readahead window that fall in the same block as the first one are put
+ * into the page cache unlocked and not up to date, so that
+ * squashfs_readpage() on the first page finds and fills them all.
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+
+	TRACE("Entered squashfs_readpages, %u pages\n", nr_pages);
+
+	while (!list_empty(pages)) {
+		struct page *target = list_entry(pages->prev, struct page, lru);
+		struct page *page, *next;
+
+		list_del(&target->lru);
+		if (add_to_page_cache_lru(target, mapping, target->index,
+					GFP_KERNEL)) {
+			page_cache_release(target);
+			continue;
+		}
+
+		list_for_each_entry_safe(page, next, pages, lru) {
+			if ((page->index >> shift) != (target->index >> shift))
+				continue;
+
+			list_del(&page->lru);
+			if (!add_to_page_cache_lru(page, mapping, page->index,
+						GFP_KERNEL))
+				unlock_page(page);
+			page_cache_release(page);
+		}
+
+		squashfs_readpage(file, target);
+		page_cache_release(target);
+	}
+
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
@@ -0,0 +1,145 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * lzma_wrapper.c
+ */
+
+/*
+ * This file implements LZMA decompression using the unlzma code in lib/.
+ * unlzma decompresses whole buffers, allocates its probability tables on
+ * each call and reports errors through a global handler, so decompression
+ * may sleep and is serialised.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/buffer_head.h>
+#include <linux/decompress/unlzma.h>
+#include <asm/unaligned.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "decompressor.h"
+#include "squashfs.h"
+
+/* properties byte, dictionary size, uncompressed size */
+#define LZMA_HEADER_SIZE	13
+#define LZMA_HEADER_DST_SIZE	5
+
+struct squashfs_lzma {
+	void	*input;
+	void	*output;
+};
+
+/* protects lzma_error, and unlzma's own error handler */
+static DEFINE_MUTEX(lzma_mutex);
+static int lzma_error;
+
+static void lzma_error_fn(char *m)
+{
+	ERROR("unlzma error: %s\n", m);
+	lzma_error = 1;
+}
+
+
+static void lzma_free(void *strm)
+{
+	struct squashfs_lzma *stream = strm;
+
+	if (stream) {
+		vfree(stream->input);
+		vfree(stream->output);
+	}
+	kfree(stream);
+}
+
+
+static void *lzma_init(struct squashfs_sb_info *msblk)
+{
+	int block_size = max_t(int, msblk->block_size, SQUASHFS_METADATA_SIZE);
+	struct squashfs_lzma *stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+
+	if (stream == NULL)
+		goto failed;
+	stream->input = vmalloc(block_size);
+	if (stream->input == NULL)
+		goto failed;
+	stream->output = vmalloc(block_size);
+	if (stream->output == NULL)
+		goto failed;
+
+	return stream;
+
+failed:
+	ERROR("Failed to allocate lzma workspace\n");
+	lzma_free(stream);
+	return NULL;
+}
+
+
+static int lzma_uncompress(struct squashfs_sb_info *msblk, void *strm,
+	void **buffer, struct buffer_head **bh, int b, int offset, int length,
+	int srclength, int pages)
+{
+	struct squashfs_lzma *stream = strm;
+	u64 bytes;
+	int res;
+
+	if (length < LZMA_HEADER_SIZE)
+		goto failed;
+
+	squashfs_bh_to_buf(msblk, stream->input, bh, b, offset, length);
+
+	/* unlzma trusts the header, don't let it write past the output */
+	bytes = get_unaligned_le64(stream->input + LZMA_HEADER_DST_SIZE);
+	if (bytes > srclength)
+		goto failed;
+
+	mutex_lock(&lzma_mutex);
+	lzma_error = 0;
+	res = unlzma(stream->input, length, NULL, NULL, stream->output, NULL,
+		lzma_error_fn);
+	if (res || lzma_error) {
+		mutex_unlock(&lzma_mutex);
+		goto failed;
+	}
+	mutex_unlock(&lzma_mutex);
+
+	squashfs_buf_to_pages(stream->output, buffer, pages, bytes);
+	return bytes;
+
+failed:
+	ERROR("lzma decompression failed, data probably corrupt\n");
+	return -EIO;
+}
+
+const struct squashfs_decompressor squashfs_lzma_comp_ops = {
+	.init = lzma_init,
+	.free = lzma_free,
+	.decompress = lzma_uncompress,
+	.id = LZMA_COMPRESSION,
+	.name = "lzma",
+	.supported = 1,
+	.may_sleep = 1
+};
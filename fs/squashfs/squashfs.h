@@ -36,6 +36,15 @@ static inline struct squashfs_inode_info *squashfs_i(struct inode *inode)
 extern int squashfs_read_data(struct super_block *, void **, u64, int, u64 *,
 				int, int);
 
+/* stream.c */
+extern int squashfs_stream_create(struct squashfs_sb_info *);
+extern void squashfs_stream_destroy(struct squashfs_sb_info *);
+extern int squashfs_decompress(struct squashfs_sb_info *, void **,
+				struct buffer_head **, int, int, int, int, int);
+
+/* decompressor.c */
+extern const struct squashfs_decompressor *squashfs_lookup_decompressor(int);
+
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
 extern void squashfs_cache_delete(struct squashfs_cache *);
@@ -88,3 +97,16 @@ extern const struct inode_operations squashfs_dir_inode_ops;
 
 /* symlink.c */
 extern const struct address_space_operations squashfs_symlink_aops;
+
+/*
+ * Decompressors
+ */
+
+/* zlib_wrapper.c */
+extern const struct squashfs_decompressor squashfs_zlib_comp_ops;
+
+/* lzma_wrapper.c */
+extern const struct squashfs_decompressor squashfs_lzma_comp_ops;
+
+/* lzo_wrapper.c */
+extern const struct squashfs_decompressor squashfs_lzo_comp_ops;
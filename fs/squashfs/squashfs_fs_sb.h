@@ -28,7 +28,6 @@
 struct squashfs_cache {
 	char			*name;
 	int			entries;
-	int			next_blk;
 	int			num_waiters;
 	int			unused;
 	int			block_size;
@@ -36,6 +35,9 @@ struct squashfs_cache {
 	spinlock_t		lock;
 	wait_queue_head_t	wait_queue;
 	struct squashfs_cache_entry *entry;
+	struct hlist_head	*hash;
+	int			hash_bits;
+	struct list_head	lru;
 };
 
 struct squashfs_cache_entry {
@@ -49,8 +51,18 @@ struct squashfs_cache_entry {
 	wait_queue_head_t	wait_queue;
 	struct squashfs_cache	*cache;
 	void			**data;
+	struct hlist_node	hash;
+	struct list_head	lru;
 };
 
+/* Decompressor stream modes, the "threads=" mount option */
+#define SQUASHFS_THREADS_SINGLE	0
+#define SQUASHFS_THREADS_MULTI	1
+#define SQUASHFS_THREADS_PERCPU	2
+
+struct squashfs_stream;
+struct squashfs_decompressor;
+
 struct squashfs_sb_info {
 	int			devblksize;
 	int			devblksize_log2;
@@ -61,10 +73,14 @@ struct squashfs_sb_info {
 	__le64			*id_table;
 	__le64			*fragment_index;
 	unsigned int		*fragment_index_2;
-	struct mutex		read_data_mutex;
 	struct mutex		meta_index_mutex;
 	struct meta_index	*meta_index;
-	z_stream		stream;
+	const struct squashfs_decompressor *decompressor;
+	int			threads;
+	struct squashfs_stream	*stream;
+	int			metadata_cache_size;
+	int			fragment_cache_size;
+	int			data_cache_size;
 	__le64			*inode_lookup_table;
 	u64			inode_table;
 	u64			directory_table;
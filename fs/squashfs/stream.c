@@ -0,0 +1,267 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * stream.c
+ */
+
+/*
+ * This file manages the decompressor streams of a mounted filesystem.
+ * The "threads=" mount option selects how many blocks can be decompressed
+ * at once:
+ *
+ * single - one stream behind a mutex, all reads are serialised.
+ * multi  - a pool of streams, grown on demand up to twice the number of
+ *	    online CPUs; readers wait only when all of them are busy.
+ * percpu - one stream per possible CPU, used with preemption disabled.
+ *	    Decompressors that sleep fall back to multi.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/buffer_head.h>
+#include <linux/zlib.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "decompressor.h"
+#include "squashfs.h"
+
+struct squashfs_strm {
+	void			*stream;
+	struct list_head	list;
+};
+
+struct squashfs_stream {
+	/* threads=single */
+	struct mutex		mutex;
+	struct squashfs_strm	*single;
+
+	/* threads=multi */
+	spinlock_t		lock;
+	struct list_head	idle;
+	int			avail;
+	int			max;
+	wait_queue_head_t	wait;
+
+	/* threads=percpu */
+	struct squashfs_strm	**percpu;
+};
+
+
+static struct squashfs_strm *strm_alloc(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_strm *strm = kmalloc(sizeof(*strm), GFP_KERNEL);
+
+	if (strm == NULL)
+		return NULL;
+
+	strm->stream = squashfs_decompressor_init(msblk);
+	if (strm->stream == NULL) {
+		kfree(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+
+static void strm_free(struct squashfs_sb_info *msblk,
+	struct squashfs_strm *strm)
+{
+	if (strm) {
+		squashfs_decompressor_free(msblk, strm->stream);
+		kfree(strm);
+	}
+}
+
+
+/*
+ * Take an idle stream from the pool, allocating a new one if all are busy
+ * and the pool may grow.  Only waits if neither is possible.
+ */
+static struct squashfs_strm *get_strm(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	struct squashfs_strm *strm;
+
+	while (1) {
+		spin_lock(&stream->lock);
+		if (!list_empty(&stream->idle)) {
+			strm = list_entry(stream->idle.next,
+				struct squashfs_strm, list);
+			list_del(&strm->list);
+			spin_unlock(&stream->lock);
+			return strm;
+		}
+
+		if (stream->avail < stream->max) {
+			stream->avail++;
+			spin_unlock(&stream->lock);
+
+			strm = strm_alloc(msblk);
+			if (strm)
+				return strm;
+
+			/* out of memory, wait for one of the others */
+			spin_lock(&stream->lock);
+			stream->avail--;
+		}
+		spin_unlock(&stream->lock);
+
+		wait_event(stream->wait, !list_empty(&stream->idle));
+	}
+}
+
+
+static void put_strm(struct squashfs_stream *stream,
+	struct squashfs_strm *strm)
+{
+	spin_lock(&stream->lock);
+	list_add(&strm->list, &stream->idle);
+	spin_unlock(&stream->lock);
+	wake_up(&stream->wait);
+}
+
+
+int squashfs_stream_create(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+	struct squashfs_strm *strm;
+	int cpu;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (stream == NULL)
+		return -ENOMEM;
+
+	mutex_init(&stream->mutex);
+	spin_lock_init(&stream->lock);
+	INIT_LIST_HEAD(&stream->idle);
+	init_waitqueue_head(&stream->wait);
+	msblk->stream = stream;
+
+	if (msblk->threads == SQUASHFS_THREADS_PERCPU &&
+			msblk->decompressor->may_sleep) {
+		WARNING("%s decompressor cannot run per-CPU, using "
+			"threads=multi\n", msblk->decompressor->name);
+		msblk->threads = SQUASHFS_THREADS_MULTI;
+	}
+
+	switch (msblk->threads) {
+	case SQUASHFS_THREADS_MULTI:
+		/* one stream up front so reads cannot fail for lack of it */
+		strm = strm_alloc(msblk);
+		if (strm == NULL)
+			goto failed;
+		list_add(&strm->list, &stream->idle);
+		stream->avail = 1;
+		stream->max = num_online_cpus() * 2;
+		break;
+	case SQUASHFS_THREADS_PERCPU:
+		stream->percpu = alloc_percpu(struct squashfs_strm *);
+		if (stream->percpu == NULL)
+			goto failed;
+		for_each_possible_cpu(cpu) {
+			strm = strm_alloc(msblk);
+			if (strm == NULL)
+				goto failed;
+			*per_cpu_ptr(stream->percpu, cpu) = strm;
+		}
+		break;
+	default:
+		stream->single = strm_alloc(msblk);
+		if (stream->single == NULL)
+			goto failed;
+		break;
+	}
+
+	return 0;
+
+failed:
+	squashfs_stream_destroy(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_stream_destroy(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream = msblk->stream;
+	struct squashfs_strm *strm, *next;
+	int cpu;
+
+	if (stream == NULL)
+		return;
+
+	list_for_each_entry_safe(strm, next, &stream->idle, list)
+		strm_free(msblk, strm);
+	if (stream->percpu) {
+		for_each_possible_cpu(cpu)
+			strm_free(msblk, *per_cpu_ptr(stream->percpu, cpu));
+		free_percpu(stream->percpu);
+	}
+	strm_free(msblk, stream->single);
+	kfree(stream);
+	msblk->stream = NULL;
+}
+
+
+/*
+ * Decompress a block held in bh into buffer, using a stream chosen by the
+ * mount's threads mode.  Returns the decompressed length or -EIO.
+ */
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = msblk->stream;
+	struct squashfs_strm *strm;
+	int res;
+
+	switch (msblk->threads) {
+	case SQUASHFS_THREADS_MULTI:
+		strm = get_strm(msblk, stream);
+		res = squashfs_decompressor_decompress(msblk, strm->stream,
+			buffer, bh, b, offset, length, srclength, pages);
+		put_strm(stream, strm);
+		break;
+	case SQUASHFS_THREADS_PERCPU:
+		strm = *per_cpu_ptr(stream->percpu, get_cpu());
+		res = squashfs_decompressor_decompress(msblk, strm->stream,
+			buffer, bh, b, offset, length, srclength, pages);
+		put_cpu();
+		break;
+	default:
+		mutex_lock(&stream->mutex);
+		res = squashfs_decompressor_decompress(msblk,
+			stream->single->stream, buffer, bh, b, offset, length,
+			srclength, pages);
+		mutex_unlock(&stream->mutex);
+		break;
+	}
+
+	return res;
+}
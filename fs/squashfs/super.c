@@ -37,30 +37,124 @@
 #include <linux/module.h>
 #include <linux/zlib.h>
 #include <linux/magic.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/mount.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
+#include "decompressor.h"
 #include "squashfs.h"
 
 static struct file_system_type squashfs_fs_type;
 static const struct super_operations squashfs_super_ops;
 
-static int supported_squashfs_filesystem(short major, short minor, short comp)
+static const struct squashfs_decompressor *supported_squashfs_filesystem(
+	short major, short minor, short id)
 {
+	const struct squashfs_decompressor *decompressor;
+
 	if (major < SQUASHFS_MAJOR) {
 		ERROR("Major/Minor mismatch, older Squashfs %d.%d "
 			"filesystems are unsupported\n", major, minor);
-		return -EINVAL;
+		return NULL;
 	} else if (major > SQUASHFS_MAJOR || minor > SQUASHFS_MINOR) {
 		ERROR("Major/Minor mismatch, trying to mount newer "
 			"%d.%d filesystem\n", major, minor);
 		ERROR("Please update your kernel\n");
-		return -EINVAL;
+		return NULL;
+	}
+
+	decompressor = squashfs_lookup_decompressor(id);
+	if (!decompressor->supported) {
+		ERROR("Filesystem uses \"%s\" compression. This is not "
+			"supported\n", decompressor->name);
+		return NULL;
 	}
 
-	if (comp != ZLIB_COMPRESSION)
-		return -EINVAL;
+	return decompressor;
+}
+
+
+enum {
+	Opt_threads_single, Opt_threads_multi, Opt_threads_percpu,
+	Opt_metadata_cache, Opt_fragment_cache, Opt_data_cache, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_threads_single, "threads=single"},
+	{Opt_threads_multi, "threads=multi"},
+	{Opt_threads_percpu, "threads=percpu"},
+	{Opt_metadata_cache, "metadata_cache=%u"},
+	{Opt_fragment_cache, "fragment_cache=%u"},
+	{Opt_data_cache, "data_cache=%u"},
+	{Opt_err, NULL}
+};
+
+static const char *squashfs_threads_name[] = {
+	[SQUASHFS_THREADS_SINGLE] = "single",
+	[SQUASHFS_THREADS_MULTI] = "multi",
+	[SQUASHFS_THREADS_PERCPU] = "percpu",
+};
+
+
+static int squashfs_parse_options(struct squashfs_sb_info *msblk,
+	char *options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int token, n;
+
+	msblk->threads = SQUASHFS_THREADS_SINGLE;
+	msblk->metadata_cache_size = SQUASHFS_CACHED_BLKS;
+	msblk->fragment_cache_size = SQUASHFS_CACHED_FRAGMENTS;
+	msblk->data_cache_size = SQUASHFS_CACHED_DATA;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_threads_single:
+			msblk->threads = SQUASHFS_THREADS_SINGLE;
+			break;
+		case Opt_threads_multi:
+			msblk->threads = SQUASHFS_THREADS_MULTI;
+			break;
+		case Opt_threads_percpu:
+			msblk->threads = SQUASHFS_THREADS_PERCPU;
+			break;
+		case Opt_metadata_cache:
+		case Opt_fragment_cache:
+		case Opt_data_cache:
+			/*
+			 * The metadata cache must hold the blocks read for
+			 * one file index, see calculate_skip() in file.c.
+			 */
+			if (match_int(args, &n) || n < 1 ||
+					n > SQUASHFS_CACHED_MAX ||
+					(token == Opt_metadata_cache &&
+					 n < SQUASHFS_CACHED_BLKS)) {
+				ERROR("Bad cache size \"%s\"\n", p);
+				return -EINVAL;
+			}
+			if (token == Opt_metadata_cache)
+				msblk->metadata_cache_size = n;
+			else if (token == Opt_fragment_cache)
+				msblk->fragment_cache_size = n;
+			else
+				msblk->data_cache_size = n;
+			break;
+		default:
+			ERROR("Unrecognised mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
 
 	return 0;
 }
@@ -87,23 +181,20 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	msblk = sb->s_fs_info;
 
-	msblk->stream.workspace = kmalloc(zlib_inflate_workspacesize(),
-		GFP_KERNEL);
-	if (msblk->stream.workspace == NULL) {
-		ERROR("Failed to allocate zlib workspace\n");
+	err = squashfs_parse_options(msblk, data);
+	if (err)
 		goto failure;
-	}
 
 	sblk = kzalloc(sizeof(*sblk), GFP_KERNEL);
 	if (sblk == NULL) {
 		ERROR("Failed to allocate squashfs_super_block\n");
+		err = -ENOMEM;
 		goto failure;
 	}
 
 	msblk->devblksize = sb_min_blocksize(sb, BLOCK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
 
 	/*
@@ -131,13 +222,14 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 
 	/* Check the MAJOR & MINOR versions and compression type */
-	err = supported_squashfs_filesystem(le16_to_cpu(sblk->s_major),
+	err = -EINVAL;
+	msblk->decompressor = supported_squashfs_filesystem(
+			le16_to_cpu(sblk->s_major),
 			le16_to_cpu(sblk->s_minor),
 			le16_to_cpu(sblk->compression));
-	if (err < 0)
+	if (msblk->decompressor == NULL)
 		goto failed_mount;
 
-	err = -EINVAL;
 
 	/*
 	 * Check if there's xattrs in the filesystem.  These are not
@@ -172,6 +264,14 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (msblk->block_log > SQUASHFS_FILE_MAX_LOG)
 		goto failed_mount;
 
+	/* Allocate the decompressor streams, now the block size is known */
+	err = squashfs_stream_create(msblk);
+	if (err) {
+		ERROR("Failed to allocate decompressor streams\n");
+		goto failed_mount;
+	}
+	err = -EINVAL;
+
 	/* Check the root inode for sanity */
 	root_inode = le64_to_cpu(sblk->root_inode);
 	if (SQUASHFS_INODE_OFFSET(root_inode) > SQUASHFS_METADATA_SIZE)
@@ -183,6 +283,7 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	flags = le16_to_cpu(sblk->flags);
 
 	TRACE("Found valid superblock on %s\n", bdevname(sb->s_bdev, b));
+	TRACE("Compression is %s\n", msblk->decompressor->name);
 	TRACE("Inodes are %scompressed\n", SQUASHFS_UNCOMPRESSED_INODES(flags)
 				? "un" : "");
 	TRACE("Data is %scompressed\n", SQUASHFS_UNCOMPRESSED_DATA(flags)
@@ -206,12 +307,13 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	err = -ENOMEM;
 
 	msblk->block_cache = squashfs_cache_init("metadata",
-			SQUASHFS_CACHED_BLKS, SQUASHFS_METADATA_SIZE);
+			msblk->metadata_cache_size, SQUASHFS_METADATA_SIZE);
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
 	/* Allocate read_page block */
-	msblk->read_page = squashfs_cache_init("data", 1, msblk->block_size);
+	msblk->read_page = squashfs_cache_init("data",
+			msblk->data_cache_size, msblk->block_size);
 	if (msblk->read_page == NULL) {
 		ERROR("Failed to allocate read_page block\n");
 		goto failed_mount;
@@ -231,7 +333,7 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto allocate_lookup_table;
 
 	msblk->fragment_cache = squashfs_cache_init("fragment",
-		SQUASHFS_CACHED_FRAGMENTS, msblk->block_size);
+		msblk->fragment_cache_size, msblk->block_size);
 	if (msblk->fragment_cache == NULL) {
 		err = -ENOMEM;
 		goto failed_mount;
@@ -295,17 +397,17 @@ failed_mount:
 	kfree(msblk->inode_lookup_table);
 	kfree(msblk->fragment_index);
 	kfree(msblk->id_table);
-	kfree(msblk->stream.workspace);
+	squashfs_stream_destroy(msblk);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	kfree(sblk);
 	return err;
 
 failure:
-	kfree(msblk->stream.workspace);
+	squashfs_stream_destroy(msblk);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
-	return -ENOMEM;
+	return err;
 }
 
 
@@ -337,6 +439,26 @@ static int squashfs_remount(struct super_block *sb, int *flags, char *data)
 }
 
 
+static int squashfs_show_options(struct seq_file *seq, struct vfsmount *mnt)
+{
+	struct squashfs_sb_info *msblk = mnt->mnt_sb->s_fs_info;
+
+	if (msblk->threads != SQUASHFS_THREADS_SINGLE)
+		seq_printf(seq, ",threads=%s",
+			squashfs_threads_name[msblk->threads]);
+	if (msblk->metadata_cache_size != SQUASHFS_CACHED_BLKS)
+		seq_printf(seq, ",metadata_cache=%d",
+			msblk->metadata_cache_size);
+	if (msblk->fragment_cache_size != SQUASHFS_CACHED_FRAGMENTS)
+		seq_printf(seq, ",fragment_cache=%d",
+			msblk->fragment_cache_size);
+	if (msblk->data_cache_size != SQUASHFS_CACHED_DATA)
+		seq_printf(seq, ",data_cache=%d", msblk->data_cache_size);
+
+	return 0;
+}
+
+
 static void squashfs_put_super(struct super_block *sb)
 {
 	lock_kernel();
@@ -349,7 +471,7 @@ static void squashfs_put_super(struct super_block *sb)
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
 		kfree(sbi->meta_index);
-		kfree(sbi->stream.workspace);
+		squashfs_stream_destroy(sbi);
 		kfree(sb->s_fs_info);
 		sb->s_fs_info = NULL;
 	}
@@ -449,7 +571,8 @@ static const struct super_operations squashfs_super_ops = {
 	.destroy_inode = squashfs_destroy_inode,
 	.statfs = squashfs_statfs,
 	.put_super = squashfs_put_super,
-	.remount_fs = squashfs_remount
+	.remount_fs = squashfs_remount,
+	.show_options = squashfs_show_options
 };
 
 module_init(init_squashfs_fs);
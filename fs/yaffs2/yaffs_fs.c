@@ -51,6 +51,8 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include "asm/div64.h"
 
@@ -121,16 +123,22 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_gc_blocks = 4;	/* erased blocks to keep in hand */
+unsigned int yaffs_bg_gc_idle_ms = 500;	/* quiet time before background gc */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc_blocks, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_gc_blocks, "i");
+MODULE_PARM(yaffs_bg_gc_idle_ms, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -364,6 +372,26 @@ static const struct super_operations yaffs_super_ops = {
 	.write_super = yaffs_write_super,
 };
 
+/*
+ * Locking.  grossLock covers the allocator, gc and the rest of the state
+ * in yaffs_guts, and is only held across calls into it.  Two more locks
+ * let most readers stay clear of it:
+ *
+ * dirLock covers the directory tree and the object names.  Operations
+ * that change the tree hold it for writing.  Lookup and readdir hold it
+ * for reading, which lets lookup search a directory without the
+ * grossLock, see yaffs_FindObjectByNameUnlocked().
+ *
+ * Each object's dataLock is held for writing by anything that writes the
+ * file's data or changes its size, and for reading by readpage, which can
+ * then read whole chunks from NAND without the grossLock, see
+ * yaffs_ReadDataFromFileUnlocked().
+ *
+ * gcLock serialises the gc done ahead of writes, in yaffs_make_space(),
+ * which is called before any of the other locks are taken.
+ *
+ * Lock order is dirLock, dataLock, grossLock, and gcLock, grossLock.
+ */
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
@@ -377,6 +405,121 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
 	up(&dev->grossLock);
 }
 
+/*
+ * Most gc is done by yaffs_guts in the middle of a write, and when the
+ * device runs low on erased blocks it collects a whole block there, with
+ * the grossLock held throughout.  Writers therefore make space first: if
+ * the nChunks they are about to write could take the device below the
+ * urgent threshold, gc is done in small steps, dropping the grossLock
+ * between them, until there is room for those chunks above it.  The gc
+ * lock keeps the other writers from piling onto the same work.
+ *
+ * This is not a reservation.  Writers that get past here together can
+ * use up each other's room, and one that finds itself short still has a
+ * whole block collected inline by guts.
+ */
+#define YAFFS_HEADER_CHUNKS	3	/* Object headers written by a
+					 * directory operation */
+
+static void yaffs_make_space(yaffs_Device *dev, int nChunks)
+{
+	int spareBlocks;
+	int more;
+
+	/* Every write comes through here: hold off background gc */
+	dev->bgGcLastWrite = jiffies;
+	if (dev->bgGcThread && !dev->bgGcKick) {
+		dev->bgGcKick = 1;
+		wake_up(&dev->bgGcWait);
+	}
+
+	spareBlocks = (nChunks + dev->nChunksPerBlock - 1) /
+			dev->nChunksPerBlock;
+	if (!yaffs_GarbageCollectNeeded(dev, spareBlocks))
+		return;
+
+	down(&dev->gcLock);
+	do {
+		yaffs_GrossLock(dev);
+		more = yaffs_GarbageCollectStep(dev, spareBlocks);
+		yaffs_GrossUnlock(dev);
+		if (more)
+			cond_resched();
+	} while (more);
+	up(&dev->gcLock);
+}
+
+/*
+ * Background gc.  The thread sleeps until there have been writes, waits
+ * for yaffs_bg_gc_idle_ms without any, then collects until
+ * yaffs_bg_gc_blocks erased blocks are in hand above what the writers'
+ * gc wants, or until a writer turns up again.  An idle device costs no
+ * wakeups.
+ */
+static int yaffs_bg_gc(void *data)
+{
+	yaffs_Device *dev = data;
+	unsigned long lastWrite;
+	long delay;
+	int more;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(dev->bgGcWait,
+				dev->bgGcKick || kthread_should_stop());
+		dev->bgGcKick = 0;
+
+		/* Wait for the writers to go quiet */
+		while (!kthread_should_stop()) {
+			delay = msecs_to_jiffies(yaffs_bg_gc_idle_ms) -
+				(long)(jiffies - dev->bgGcLastWrite);
+			if (delay <= 0)
+				break;
+			schedule_timeout_interruptible(delay);
+			try_to_freeze();
+		}
+
+		do {
+			lastWrite = dev->bgGcLastWrite;
+			yaffs_GrossLock(dev);
+			more = yaffs_BackgroundGarbageCollect(dev,
+					yaffs_bg_gc_blocks);
+			yaffs_GrossUnlock(dev);
+			cond_resched();
+		} while (more && lastWrite == dev->bgGcLastWrite &&
+			 !kthread_should_stop());
+	}
+
+	return 0;
+}
+
+static void yaffs_start_bg_gc(yaffs_Device *dev)
+{
+	struct task_struct *tsk;
+
+	init_waitqueue_head(&dev->bgGcWait);
+	dev->bgGcKick = 0;
+	dev->bgGcLastWrite = jiffies;
+
+	tsk = kthread_run(yaffs_bg_gc, dev, "yaffs-gc/%s", dev->name);
+	if (IS_ERR(tsk)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background gc for %s\n",
+		   dev->name));
+		tsk = NULL;
+	}
+	dev->bgGcThread = tsk;
+}
+
+static void yaffs_stop_bg_gc(yaffs_Device *dev)
+{
+	if (dev->bgGcThread) {
+		kthread_stop(dev->bgGcThread);
+		dev->bgGcThread = NULL;
+	}
+}
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -565,19 +708,26 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	down_read(&dev->dirLock);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	if (yaffs_FindObjectByNameUnlocked(yaffs_InodeToObject(dir),
+			dentry->d_name.name, &obj) != YAFFS_OK) {
+		yaffs_GrossLock(dev);
 
-	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+		obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+
+		yaffs_GrossUnlock(dev);
+	}
+
+	/* Can't hold yaffs locks when calling yaffs_get_inode() */
+	up_read(&dev->dirLock);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -678,9 +828,11 @@ static void yaffs_delete_inode(struct inode *inode)
 
 	if (obj) {
 		dev = obj->myDev;
+		down_write(&dev->dirLock);
 		yaffs_GrossLock(dev);
 		yaffs_DeleteObject(obj);
 		yaffs_GrossUnlock(dev);
+		up_write(&dev->dirLock);
 	}
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13))
 	truncate_inode_pages(&inode->i_data, 0);
@@ -702,6 +854,7 @@ static int yaffs_file_flush(struct file *file)
 		("yaffs_file_flush object %d (%s)\n", obj->objectId,
 		obj->dirty ? "dirty" : "clean"));
 
+	yaffs_make_space(dev, dev->nShortOpCaches + 1);
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushFile(obj, 1);
@@ -739,13 +892,22 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	down_read(&obj->dataLock);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
-				pg->index << PAGE_CACHE_SHIFT,
+	ret = yaffs_ReadDataFromFileUnlocked(obj, pg_buf,
+				(loff_t)pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
+	if (ret < 0) {
+		yaffs_GrossLock(dev);
 
-	yaffs_GrossUnlock(dev);
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+
+		yaffs_GrossUnlock(dev);
+	}
+
+	up_read(&obj->dataLock);
 
 	if (ret >= 0)
 		ret = 0;
@@ -824,6 +986,9 @@ static int yaffs_writepage(struct page *page)
 	buffer = kmap(page);
 
 	obj = yaffs_InodeToObject(inode);
+	yaffs_make_space(obj->myDev,
+			nBytes / obj->myDev->nDataBytesPerChunk + 2);
+	down_write(&obj->dataLock);
 	yaffs_GrossLock(obj->myDev);
 
 	T(YAFFS_TRACE_OS,
@@ -841,6 +1006,7 @@ static int yaffs_writepage(struct page *page)
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
 	yaffs_GrossUnlock(obj->myDev);
+	up_write(&obj->dataLock);
 
 	kunmap(page);
 	SetPageUptodate(page);
@@ -1156,6 +1322,8 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->myDev;
 
+	yaffs_make_space(dev, n / dev->nDataBytesPerChunk + 2);
+	down_write(&obj->dataLock);
 	yaffs_GrossLock(dev);
 
 	inode = f->f_dentry->d_inode;
@@ -1195,6 +1363,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	}
 	yaffs_GrossUnlock(dev);
+	up_write(&obj->dataLock);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1254,6 +1423,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
+	down_read(&dev->dirLock);
 	yaffs_GrossLock(dev);
 
 	offset = f->f_pos;
@@ -1271,10 +1441,13 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			("yaffs_readdir: entry . ino %d \n",
 			(int)inode->i_ino));
 		yaffs_GrossUnlock(dev);
+		up_read(&dev->dirLock);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
+			down_read(&dev->dirLock);
 			yaffs_GrossLock(dev);
 			goto out;
 		}
+		down_read(&dev->dirLock);
 		yaffs_GrossLock(dev);
 		offset++;
 		f->f_pos++;
@@ -1284,11 +1457,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			("yaffs_readdir: entry .. ino %d \n",
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
 		yaffs_GrossUnlock(dev);
+		up_read(&dev->dirLock);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0){
+			down_read(&dev->dirLock);
 			yaffs_GrossLock(dev);
 			goto out;
 		}
+		down_read(&dev->dirLock);
 		yaffs_GrossLock(dev);
 		offset++;
 		f->f_pos++;
@@ -1319,6 +1495,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			   yaffs_GetObjectInode(l)));
 
                         yaffs_GrossUnlock(dev);
+			up_read(&dev->dirLock);
 
 			if (filldir(dirent,
 					name,
@@ -1326,10 +1503,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					offset,
 					this_inode,
 					this_type) < 0){
+				down_read(&dev->dirLock);
 				yaffs_GrossLock(dev);
 				goto out;
 			}
 
+			down_read(&dev->dirLock);
                         yaffs_GrossLock(dev);
 
 			offset++;
@@ -1341,6 +1520,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
         yaffs_EndSearch(sc);
 	yaffs_GrossUnlock(dev);
+	up_read(&dev->dirLock);
 
 	return retVal;
 }
@@ -1393,6 +1573,8 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	dev = parent->myDev;
 
+	yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+	down_write(&dev->dirLock);
 	yaffs_GrossLock(dev);
 
 	switch (mode & S_IFMT) {
@@ -1426,6 +1608,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	/* Can not call yaffs_get_inode() with gross lock held */
 	yaffs_GrossUnlock(dev);
+	up_write(&dev->dirLock);
 
 	if (obj) {
 		inode = yaffs_get_inode(dir->i_sb, mode, rdev, obj);
@@ -1475,6 +1658,8 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 
 	dev = yaffs_InodeToObject(dir)->myDev;
 
+	yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+	down_write(&dev->dirLock);
 	yaffs_GrossLock(dev);
 
 	retVal = yaffs_Unlink(yaffs_InodeToObject(dir), dentry->d_name.name);
@@ -1483,11 +1668,13 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
 		yaffs_GrossUnlock(dev);
+		up_write(&dev->dirLock);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
 	yaffs_GrossUnlock(dev);
+	up_write(&dev->dirLock);
 	return -ENOTEMPTY;
 }
 
@@ -1507,6 +1694,8 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	obj = yaffs_InodeToObject(inode);
 	dev = obj->myDev;
 
+	yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+	down_write(&dev->dirLock);
 	yaffs_GrossLock(dev);
 
 	if (!S_ISDIR(inode->i_mode))		/* Don't link directories */
@@ -1524,6 +1713,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	}
 
 	yaffs_GrossUnlock(dev);
+	up_write(&dev->dirLock);
 
 	if (link){
 		update_dir_time(dir);
@@ -1544,10 +1734,13 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_symlink\n"));
 
 	dev = yaffs_InodeToObject(dir)->myDev;
+	yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+	down_write(&dev->dirLock);
 	yaffs_GrossLock(dev);
 	obj = yaffs_MknodSymLink(yaffs_InodeToObject(dir), dentry->d_name.name,
 				S_IFLNK | S_IRWXUGO, uid, gid, symname);
 	yaffs_GrossUnlock(dev);
+	up_write(&dev->dirLock);
 
 	if (obj) {
 		struct inode *inode;
@@ -1576,6 +1769,7 @@ static int yaffs_sync_object(struct file *file, struct dentry *dentry,
 	dev = obj->myDev;
 
 	T(YAFFS_TRACE_OS, ("yaffs_sync_object\n"));
+	yaffs_make_space(dev, dev->nShortOpCaches + 1);
 	yaffs_GrossLock(dev);
 	yaffs_FlushFile(obj, 1);
 	yaffs_GrossUnlock(dev);
@@ -1597,6 +1791,8 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_rename\n"));
 	dev = yaffs_InodeToObject(old_dir)->myDev;
 
+	yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+	down_write(&dev->dirLock);
 	yaffs_GrossLock(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
@@ -1628,12 +1824,14 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		}
 		
 		yaffs_GrossUnlock(dev);
+		up_write(&dev->dirLock);
 		update_dir_time(old_dir);
 		if(old_dir != new_dir)
 			update_dir_time(new_dir);
 		return 0;
 	} else {
 		yaffs_GrossUnlock(dev);
+		up_write(&dev->dirLock);
 		return -ENOTEMPTY;
 	}
 }
@@ -1641,24 +1839,25 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 {
 	struct inode *inode = dentry->d_inode;
+	yaffs_Object *obj = yaffs_InodeToObject(inode);
 	int error;
 	yaffs_Device *dev;
 
 	T(YAFFS_TRACE_OS,
-		("yaffs_setattr of object %d\n",
-		yaffs_InodeToObject(inode)->objectId));
+		("yaffs_setattr of object %d\n", obj->objectId));
 
 	error = inode_change_ok(inode, attr);
 	if (error == 0) {
-		dev = yaffs_InodeToObject(inode)->myDev;
+		dev = obj->myDev;
+		yaffs_make_space(dev, YAFFS_HEADER_CHUNKS);
+		down_write(&obj->dataLock);
 		yaffs_GrossLock(dev);
-		if (yaffs_SetAttributes(yaffs_InodeToObject(inode), attr) ==
-				YAFFS_OK) {
+		if (yaffs_SetAttributes(obj, attr) == YAFFS_OK)
 			error = 0;
-		} else {
+		else
 			error = -EPERM;
-		}
 		yaffs_GrossUnlock(dev);
+		up_write(&obj->dataLock);
 		if (!error)
 			error = inode_setattr(inode, attr);
 	}
@@ -1886,6 +2085,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_stop_bg_gc(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -2271,6 +2472,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&dev->grossLock);
+	init_MUTEX(&dev->gcLock);
+	init_rwsem(&dev->dirLock);
 
 	yaffs_GrossLock(dev);
 
@@ -2306,6 +2509,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	}
 	sb->s_root = root;
 	sb->s_dirt = !dev->isCheckpointed;
+
+	yaffs_start_bg_gc(dev);
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
@@ -2433,6 +2638,8 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -75,6 +75,10 @@ static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
 static int yaffs_DoGenericObjectDeletion(yaffs_Object *in);
 
 static yaffs_BlockInfo *yaffs_GetBlockInfo(yaffs_Device *dev, int blockNo);
+static void yaffs_GcIndexUpdate(yaffs_Device *dev, int blockNo);
+static void yaffs_GcIndexRebuild(yaffs_Device *dev);
+static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
+					yaffs_BlockInfo *bi);
 
 
 static int yaffs_CheckChunkErased(struct yaffs_DeviceStruct *dev,
@@ -113,6 +117,15 @@ static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
 					yaffs_FileStructure *fStruct,
 					__u32 chunkId);
 
+/* Tnode updates are bracketed for readers that skip the grossLock */
+#ifdef __KERNEL__
+#define yaffs_DataSeqBegin(obj)	write_seqcount_begin(&(obj)->dataSeq)
+#define yaffs_DataSeqEnd(obj)	write_seqcount_end(&(obj)->dataSeq)
+#else
+#define yaffs_DataSeqBegin(obj)	do { } while (0)
+#define yaffs_DataSeqEnd(obj)	do { } while (0)
+#endif
+
 /* Function to calculate chunk and offset */
 
 static void yaffs_AddrToChunk(yaffs_Device *dev, loff_t addr, int *chunkOut,
@@ -1048,6 +1061,7 @@ static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND)
 	bi->blockState = YAFFS_BLOCK_STATE_DEAD;
 	bi->gcPrioritise = 0;
 	bi->needsRetiring = 0;
+	yaffs_GcIndexUpdate(dev, blockInNAND);
 
 	dev->nRetiredBlocks++;
 }
@@ -1665,6 +1679,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 	if (theBlock) {
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
+		yaffs_GcIndexUpdate(dev, chunk / dev->nChunksPerBlock);
 	}
 }
 
@@ -1921,6 +1936,9 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+#ifdef __KERNEL__
+		init_rwsem(&tn->dataLock);
+#endif
 
 
 		/* Now make the directory sane */
@@ -2535,6 +2553,7 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 
 	dev->blockInfo = NULL;
 	dev->chunkBits = NULL;
+	dev->gcIndex = NULL;
 
 	dev->allocationBlock = -1;	/* force it to get a new one */
 
@@ -2558,8 +2577,20 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	}
 
 	if (dev->blockInfo && dev->chunkBits) {
+		int nLinks = nBlocks + dev->nChunksPerBlock + 1;
+
+		dev->gcIndex = YMALLOC(nLinks * sizeof(yaffs_GcIndexLink));
+		if (!dev->gcIndex) {
+			dev->gcIndex = YMALLOC_ALT(nLinks * sizeof(yaffs_GcIndexLink));
+			dev->gcIndexAlt = 1;
+		} else
+			dev->gcIndexAlt = 0;
+	}
+
+	if (dev->blockInfo && dev->chunkBits && dev->gcIndex) {
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+		yaffs_GcIndexRebuild(dev);
 		return YAFFS_OK;
 	}
 
@@ -2583,6 +2614,109 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->gcIndexAlt && dev->gcIndex)
+		YFREE_ALT(dev->gcIndex);
+	else if (dev->gcIndex)
+		YFREE(dev->gcIndex);
+	dev->gcIndexAlt = 0;
+	dev->gcIndex = NULL;
+}
+
+/*
+ * The gc index keeps the full blocks in doubly linked lists, one per count
+ * of live (in use and not soft deleted) chunks, so that the dirtiest block
+ * is found without scanning all the block info.  Blocks are refiled
+ * whenever their state or counts change.
+ */
+static int yaffs_GcIndexHead(yaffs_Device *dev, int live)
+{
+	if (live < 0)
+		live = 0;
+	if (live > dev->nChunksPerBlock)
+		live = dev->nChunksPerBlock;
+
+	return dev->internalEndBlock - dev->internalStartBlock + 1 + live;
+}
+
+static void yaffs_GcIndexUpdate(yaffs_Device *dev, int blockNo)
+{
+	yaffs_GcIndexLink *link = dev->gcIndex;
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blockNo);
+	int n = blockNo - dev->internalStartBlock;
+	int head;
+
+	if (!link)
+		return;
+
+	if (link[n].next >= 0) {
+		link[link[n].prev].next = link[n].next;
+		link[link[n].next].prev = link[n].prev;
+		link[n].next = -1;
+		link[n].prev = -1;
+	}
+
+	if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+		return;
+
+	/* Add at the tail, so each list is in the order blocks filled up */
+	head = yaffs_GcIndexHead(dev, bi->pagesInUse - bi->softDeletions);
+	link[n].next = head;
+	link[n].prev = link[head].prev;
+	link[link[head].prev].next = n;
+	link[head].prev = n;
+}
+
+static void yaffs_GcIndexRebuild(yaffs_Device *dev)
+{
+	yaffs_GcIndexLink *link = dev->gcIndex;
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int i;
+
+	for (i = 0; i < nBlocks; i++) {
+		link[i].next = -1;
+		link[i].prev = -1;
+	}
+
+	for (i = nBlocks; i <= nBlocks + dev->nChunksPerBlock; i++) {
+		link[i].next = i;
+		link[i].prev = i;
+	}
+
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++)
+		yaffs_GcIndexUpdate(dev, i);
+}
+
+/* Dirtiest full block that can be collected and has no more than maxLive
+ * live chunks, or -1.
+ */
+static int yaffs_GcIndexFindDirtiest(yaffs_Device *dev, int maxLive)
+{
+	yaffs_GcIndexLink *link = dev->gcIndex;
+	yaffs_BlockInfo *bi;
+	int live, head, n, next, blockNo;
+
+	for (live = 0; live <= maxLive; live++) {
+		head = yaffs_GcIndexHead(dev, live);
+
+		for (n = link[head].next; n != head; n = next) {
+			next = link[n].next;
+			blockNo = n + dev->internalStartBlock;
+			bi = yaffs_GetBlockInfo(dev, blockNo);
+
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+			    (bi->pagesInUse - bi->softDeletions) != live) {
+				/* Changed behind our back, file it properly */
+				yaffs_GcIndexUpdate(dev, blockNo);
+				continue;
+			}
+
+			if (yaffs_BlockNotDisqualifiedFromGC(dev, bi))
+				return blockNo;
+		}
+	}
+
+	return -1;
 }
 
 static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
@@ -2629,10 +2763,7 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive)
 {
-	int b = dev->currentDirtyChecker;
-
 	int i;
-	int iterations;
 	int dirtiest = -1;
 	int pagesInUse = 0;
 	int prioritised = 0;
@@ -2673,44 +2804,16 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	if (!aggressive && (dev->nonAggressiveSkip > 0))
 		return -1;
 
-	if (!prioritised)
-		pagesInUse =
-			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
-
-	if (aggressive)
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-	else {
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-		iterations = iterations / 16;
-		if (iterations > 200)
-			iterations = 200;
-	}
-
-	for (i = 0; i <= iterations && pagesInUse > 0 && !prioritised; i++) {
-		b++;
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock)
-			b = dev->internalStartBlock;
-
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock) {
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("**>> Block %d is not valid" TENDSTR), b));
-			YBUG();
-		}
-
-		bi = yaffs_GetBlockInfo(dev, b);
-
-		if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-			(bi->pagesInUse - bi->softDeletions) < pagesInUse &&
-				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
-			dirtiest = b;
+	/* The gc index hands us the dirtiest block directly */
+	if (!prioritised) {
+		dirtiest = yaffs_GcIndexFindDirtiest(dev,
+			(aggressive) ? dev->nChunksPerBlock - 1 : YAFFS_PASSIVE_GC_CHUNKS);
+		if (dirtiest > 0) {
+			bi = yaffs_GetBlockInfo(dev, dirtiest);
 			pagesInUse = (bi->pagesInUse - bi->softDeletions);
 		}
 	}
 
-	dev->currentDirtyChecker = b;
-
 	if (dirtiest > 0) {
 		T(YAFFS_TRACE_GC,
 		  (TSTR("GC Selected block %d with %d free, prioritised:%d" TENDSTR), dirtiest,
@@ -2740,6 +2843,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		blockNo, bi->blockState, (bi->needsRetiring) ? "needs retiring" : ""));
 
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_GcIndexUpdate(dev, blockNo);
 
 	if (!bi->needsRetiring) {
 		yaffs_InvalidateCheckpoint(dev);
@@ -2934,6 +3038,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* If the block is full set the state to full */
 		if (dev->allocationPage >= dev->nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GcIndexUpdate(dev, dev->allocationBlock);
 			dev->allocationBlock = -1;
 		}
 
@@ -2996,8 +3101,10 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 	/*yaffs_VerifyFreeChunks(dev); */
 
-	if(bi->blockState == YAFFS_BLOCK_STATE_FULL)
+	if(bi->blockState == YAFFS_BLOCK_STATE_FULL) {
 		bi->blockState = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_GcIndexUpdate(dev, block);
+	}
 	
 	bi->hasShrinkHeader = 0;	/* clear the flag so that the block can erase */
 
@@ -3213,6 +3320,32 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/* Number of erased blocks below which the next allocation needs a whole
+ * block collected first.
+ */
+static int yaffs_GarbageCollectThresholdFor(yaffs_Device *dev,
+					int checkpointBlocks)
+{
+	int checkpointBlockAdjust;
+
+	checkpointBlockAdjust = checkpointBlocks - dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	return dev->nReservedBlocks + checkpointBlockAdjust + 2;
+}
+
+static int yaffs_GarbageCollectThreshold(yaffs_Device *dev)
+{
+	return yaffs_GarbageCollectThresholdFor(dev,
+				yaffs_CalcCheckpointBlocksRequired(dev));
+}
+
+static int yaffs_GarbageCollectUrgent(yaffs_Device *dev)
+{
+	return (dev->nErasedBlocks < yaffs_GarbageCollectThreshold(dev)) ? 1 : 0;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -3229,8 +3362,6 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
 
-	int checkpointBlockAdjust;
-
 	if (dev->isDoingGC) {
 		/* Bail out so we don't get recursive gc */
 		return YAFFS_OK;
@@ -3243,17 +3374,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	do {
 		maxTries++;
 
-		checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
-		if (checkpointBlockAdjust < 0)
-			checkpointBlockAdjust = 0;
-
-		if (dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2)) {
-			/* We need a block soon...*/
-			aggressive = 1;
-		} else {
-			/* We're in no hurry */
-			aggressive = 0;
-		}
+		/* Aggressive if we need a block soon, else we're in no hurry */
+		aggressive = yaffs_GarbageCollectUrgent(dev);
 
 		if (dev->gcBlock <= 0) {
 			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive);
@@ -3288,6 +3410,105 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* Cheap check, safe without the grossLock, of whether
+ * yaffs_GarbageCollectStep() has anything to do.  It may say yes when
+ * the answer is no, but not the other way round.  The cached checkpoint
+ * size is only read here: if it is not worked out yet, say yes and let
+ * the locked check fill it in.
+ */
+int yaffs_GarbageCollectNeeded(yaffs_Device *dev, int spareBlocks)
+{
+	int checkpointBlocks = dev->nCheckpointBlocksRequired;
+
+	if (dev->isYaffs2 && !checkpointBlocks)
+		return 1;
+
+	return dev->nErasedBlocks <
+		yaffs_GarbageCollectThresholdFor(dev, checkpointBlocks) +
+		spareBlocks;
+}
+
+/* Incremental form of the aggressive gc above, for callers that want to
+ * make room before starting an operation instead of collecting a whole
+ * block in the middle of it.  Each call copies at most a few chunks off
+ * the block being collected, so the caller can let others at the device
+ * between calls.  spareBlocks is the number of erased blocks the caller
+ * is about to write into, on top of what the allocator keeps back.
+ * Returns 1 while that space is still missing and there is a block to
+ * collect, 0 once the caller can go ahead.
+ */
+int yaffs_GarbageCollectStep(yaffs_Device *dev, int spareBlocks)
+{
+	if (dev->isDoingGC ||
+	    dev->nErasedBlocks >= yaffs_GarbageCollectThreshold(dev) + spareBlocks)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, 1);
+		dev->gcChunk = 0;
+	}
+
+	if (dev->gcBlock <= 0)
+		return 0;
+
+	dev->garbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: GC step erasedBlocks %d block %d chunk %d" TENDSTR),
+	   dev->nErasedBlocks, dev->gcBlock, dev->gcChunk));
+
+	if (yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0) != YAFFS_OK)
+		return 0;
+
+	return (dev->nErasedBlocks <
+		yaffs_GarbageCollectThreshold(dev) + spareBlocks) ? 1 : 0;
+}
+
+/* Background gc, run while the device is idle to keep spareBlocks erased
+ * blocks in hand above the urgent threshold, so that writers seldom have
+ * to collect themselves.  Works in the same small steps as
+ * yaffs_GarbageCollectStep() and skips blocks that are mostly live data:
+ * copying those buys little space for a lot of flash wear.
+ * Returns 1 if there may be more to do.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int spareBlocks)
+{
+	yaffs_BlockInfo *bi;
+	int block;
+
+	if (dev->isDoingGC)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		if (dev->nErasedBlocks >=
+				yaffs_GarbageCollectThreshold(dev) + spareBlocks)
+			return 0;
+
+		block = yaffs_FindBlockForGarbageCollection(dev, 1);
+		if (block <= 0)
+			return 0;
+
+		bi = yaffs_GetBlockInfo(dev, block);
+		if (!bi->gcPrioritise &&
+		    (bi->pagesInUse - bi->softDeletions) > dev->nChunksPerBlock / 2)
+			return 0;
+
+		dev->gcBlock = block;
+		dev->gcChunk = 0;
+	}
+
+	dev->backgroundGarbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC erasedBlocks %d block %d chunk %d" TENDSTR),
+	   dev->nErasedBlocks, dev->gcBlock, dev->gcChunk));
+
+	if (yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0) != YAFFS_OK)
+		return 0;
+
+	return 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3452,10 +3673,12 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
+	yaffs_DataSeqBegin(in);
 	tn = yaffs_AddOrFindLevel0Tnode(dev,
 					&in->variant.fileVariant,
 					chunkInInode,
 					NULL);
+	yaffs_DataSeqEnd(in);
 	if (!tn)
 		return YAFFS_FAIL;
 
@@ -3539,7 +3762,9 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 	if (existingChunk == 0)
 		in->nDataChunks++;
 
+	yaffs_DataSeqBegin(in);
 	yaffs_PutLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	yaffs_DataSeqEnd(in);
 
 	return YAFFS_OK;
 }
@@ -3613,6 +3838,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 		yaffs_ClearChunkBit(dev, block, page);
 
 		bi->pagesInUse--;
+		yaffs_GcIndexUpdate(dev, block);
 
 		if (bi->pagesInUse == 0 &&
 		    !bi->hasShrinkHeader &&
@@ -4770,6 +4996,125 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+#ifdef __KERNEL__
+/* yaffs_FindChunkInFile() for readers that do not hold the grossLock.
+ * Nothing read from the tnode tree is followed until dataSeq says it
+ * was not being changed.
+ * Returns the NAND chunk, 0 for a hole or -1 if the tree changed.
+ */
+static int yaffs_FindChunkInFileUnlocked(yaffs_Object *in, int chunkInInode,
+					unsigned seq)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_Tnode *tn = in->variant.fileVariant.top;
+	int level = in->variant.fileVariant.topLevel;
+	int requiredTallness = 0;
+	__u32 i;
+	int theChunk;
+
+	if (read_seqcount_retry(&in->dataSeq, seq))
+		return -1;
+
+	if (level < 0 || level > YAFFS_TNODES_MAX_LEVEL ||
+	    chunkInInode > YAFFS_MAX_CHUNK_ID)
+		return 0;
+
+	i = chunkInInode >> YAFFS_TNODES_LEVEL0_BITS;
+	while (i) {
+		i >>= YAFFS_TNODES_INTERNAL_BITS;
+		requiredTallness++;
+	}
+
+	if (requiredTallness > level)
+		return 0;
+
+	while (level > 0 && tn) {
+		tn = tn->internal[(chunkInInode >>
+			(YAFFS_TNODES_LEVEL0_BITS +
+				(level - 1) *
+				YAFFS_TNODES_INTERNAL_BITS)) &
+			YAFFS_TNODES_INTERNAL_MASK];
+		level--;
+		if (read_seqcount_retry(&in->dataSeq, seq))
+			return -1;
+	}
+
+	if (!tn)
+		return 0;
+
+	theChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+	if (read_seqcount_retry(&in->dataSeq, seq))
+		return -1;
+
+	if (theChunk > 0 &&
+	    yaffs_CheckChunkBit(dev, theChunk / dev->nChunksPerBlock,
+				theChunk % dev->nChunksPerBlock))
+		return theChunk;
+
+	return 0;
+}
+
+/* Read whole chunks of a file without the grossLock, for the common case
+ * of readpage on a yaffs2 device.  The caller holds the object's dataLock
+ * for reading, so the file is not being written, truncated or deleted and
+ * the only thing that can change its tnodes is gc moving a chunk, which
+ * bumps dataSeq.  A read that overlaps a move is abandoned, as is any
+ * read that would need the chunk cache or the ECC error handling.
+ * Returns the number of bytes read, or -1 if the caller must fall back to
+ * yaffs_ReadDataFromFile() under the grossLock.
+ */
+int yaffs_ReadDataFromFileUnlocked(yaffs_Object *in, __u8 *buffer,
+				loff_t offset, int nBytes)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunk;
+	__u32 start;
+	int chunkInNAND;
+	int nDone;
+	unsigned seq;
+	int i;
+
+	if (!dev->isYaffs2 || dev->inbandTags || dev->chunkGroupSize != 1 ||
+	    in->variantType != YAFFS_OBJECT_TYPE_FILE ||
+	    nBytes % dev->nDataBytesPerChunk)
+		return -1;
+
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	if (start)
+		return -1;
+	chunk++;
+
+	seq = in->dataSeq.sequence;
+	smp_rmb();
+	if (seq & 1)
+		return -1;
+
+	/* Dirty cached chunks are newer than what is on NAND */
+	for (i = 0; i < dev->nShortOpCaches; i++) {
+		if (dev->srCache[i].object == in && dev->srCache[i].dirty)
+			return -1;
+	}
+
+	for (nDone = 0; nDone < nBytes; nDone += dev->nDataBytesPerChunk) {
+		chunkInNAND = yaffs_FindChunkInFileUnlocked(in, chunk++, seq);
+		if (chunkInNAND < 0)
+			return -1;
+
+		if (!chunkInNAND)
+			memset(buffer + nDone, 0, dev->nDataBytesPerChunk);
+		else if (yaffs_ReadChunkDataFromNANDUnlocked(dev, chunkInNAND,
+					buffer + nDone) != YAFFS_OK)
+			return -1;
+	}
+
+	/* The chunks may have been moved, and rewritten, while we read */
+	if (read_seqcount_retry(&in->dataSeq, seq))
+		return -1;
+
+	return nDone;
+}
+#endif
+
 int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -6049,7 +6394,6 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 #endif
 
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6082,6 +6426,12 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+		/* Lock-free lookups only trust the name once this is clear */
+#ifdef __KERNEL__
+		smp_wmb();
+#endif
+		in->lazyLoaded = 0;
 	}
 }
 
@@ -6972,6 +7322,67 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	return NULL;
 }
 
+#ifdef __KERNEL__
+/* yaffs_FindObjectByName() for callers that hold the device's dirLock but
+ * not its grossLock.  The directory cannot change under dirLock, so all
+ * this has to avoid is the NAND: it gives up if any child has not had its
+ * details loaded yet, or if a name is not held in RAM.
+ * Returns YAFFS_OK with the object, or NULL, in *objOut, or YAFFS_FAIL if
+ * the caller must use yaffs_FindObjectByName() under the grossLock.
+ */
+int yaffs_FindObjectByNameUnlocked(yaffs_Object *directory,
+				const YCHAR *name, yaffs_Object **objOut)
+{
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	int sum;
+	struct ylist_head *i;
+	yaffs_Object *l = NULL;
+
+	*objOut = NULL;
+
+	if (!name || !directory ||
+	    directory->variantType != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return YAFFS_FAIL;
+
+	sum = yaffs_CalcNameSum(name);
+
+	ylist_for_each(i, &directory->variant.directoryVariant.children) {
+		l = ylist_entry(i, yaffs_Object, siblings);
+
+		if (l->lazyLoaded)
+			return YAFFS_FAIL;
+		/* Pairs with the smp_wmb() in yaffs_CheckObjectDetailsLoaded() */
+		smp_rmb();
+
+		if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
+			if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
+				break;
+		} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
+			if (l->hdrChunk <= 0 || !l->shortName[0])
+				return YAFFS_FAIL;
+			if (yaffs_strncmp(name, l->shortName,
+					  YAFFS_MAX_NAME_LENGTH) == 0)
+				break;
+		}
+	}
+
+	if (i == &directory->variant.directoryVariant.children)
+		return YAFFS_OK;
+
+	if (l->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+		l = l->variant.hardLinkVariant.equivalentObject;
+		if (!l || l->lazyLoaded)
+			return YAFFS_FAIL;
+	}
+
+	*objOut = l;
+	return YAFFS_OK;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+#endif
+
 
 #if 0
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
@@ -7438,7 +7849,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
-	dev->currentDirtyChecker = 0;
+	dev->backgroundGarbageCollections = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -7578,6 +7989,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	yaffs_VerifyFreeChunks(dev);
 	yaffs_VerifyBlocks(dev);
 
+	/* The scan and checkpoint restore set up block states wholesale */
+	yaffs_GcIndexRebuild(dev);
+
 	/* Clean up any aborted checkpoint data */
 	if (!dev->isCheckpointed && dev->blocksInCheckpoint > 0)
 		yaffs_InvalidateCheckpoint(dev);
@@ -294,6 +294,16 @@ typedef struct {
 
 } yaffs_BlockInfo;
 
+/* Link in the gc index, which keeps the full blocks in lists by the number
+ * of live chunks they hold.  The first entries are the blocks, followed by
+ * one list head for each possible count.  Kept outside yaffs_BlockInfo so
+ * that the checkpointed block info is unchanged.
+ */
+typedef struct {
+	int next;
+	int prev;
+} yaffs_GcIndexLink;
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -473,7 +483,11 @@ struct yaffs_ObjectStruct {
 
 #ifdef __KERNEL__
 	struct inode *myInode;
-
+	struct rw_semaphore dataLock;	/* Held for writing across changes
+					 * to the file data, for reading by
+					 * readers that skip the grossLock.
+					 */
+	seqcount_t dataSeq;		/* Bumped around tnode updates */
 #endif
 
 	yaffs_ObjectType variantType;
@@ -639,8 +653,13 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
-	struct rw_semaphore dirLock; /* Lock the directory structure */
+	struct semaphore grossLock;	/* Allocator, gc and NAND state */
+	struct semaphore gcLock;	/* Serialises gc done ahead of writes */
+	struct task_struct *bgGcThread;	/* Background gc, NULL if not running */
+	wait_queue_head_t bgGcWait;
+	int bgGcKick;			/* Set by writers to wake bgGcThread */
+	unsigned long bgGcLastWrite;	/* jiffies of the last write */
+	struct rw_semaphore dirLock;	/* Directory tree and names */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 
@@ -687,6 +706,8 @@ struct yaffs_DeviceStruct {
 	int chunkBitmapStride;	/* Number of bytes of chunkBits per block.
 				 * Must be consistent with nChunksPerBlock.
 				 */
+	yaffs_GcIndexLink *gcIndex;	/* full blocks by live chunk count */
+	unsigned gcIndexAlt:1;	/* was allocated using alternative strategy */
 
 	int nErasedBlocks;
 	int allocationBlock;	/* Current block being allocated off */
@@ -715,7 +736,6 @@ struct yaffs_DeviceStruct {
 
 	int nFreeChunks;
 
-	int currentDirtyChecker;	/* Used to find current dirtiest block */
 
 	__u32 *gcCleanupList;	/* objects to delete at the end of a GC. */
 	int nonAggressiveSkip;	/* GC state/mode */
@@ -728,6 +748,7 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -856,6 +877,10 @@ int yaffs_FlushFile(yaffs_Object *obj, int updateTime);
 /* Flushing and checkpointing */
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 
+int yaffs_GarbageCollectNeeded(yaffs_Device *dev, int spareBlocks);
+int yaffs_GarbageCollectStep(yaffs_Device *dev, int spareBlocks);
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int spareBlocks);
+
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
@@ -896,6 +921,12 @@ void yfsd_WinFileTimeNow(__u32 target[2]);
 #ifdef __KERNEL__
 
 void yaffs_HandleDeferedFree(yaffs_Object *obj);
+
+/* Lock-free fast paths, see yaffs_fs.c for the locking */
+int yaffs_ReadDataFromFileUnlocked(yaffs_Object *in, __u8 *buffer,
+				loff_t offset, int nBytes);
+int yaffs_FindObjectByNameUnlocked(yaffs_Object *directory,
+				const YCHAR *name, yaffs_Object **objOut);
 #endif
 
 /* Debug dump  */
@@ -178,9 +178,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	if (localData)
 		yaffs_ReleaseTempBuffer(dev, data, __LINE__);
 
-	if (tags->eccResult == YAFFS_ECC_RESULT_FIXED)
+	if (tags && tags->eccResult == YAFFS_ECC_RESULT_FIXED)
 		dev->tagsEccFixed++;
-	if (tags->eccResult == YAFFS_ECC_RESULT_UNFIXED)
+	if (tags && tags->eccResult == YAFFS_ECC_RESULT_UNFIXED)
 		dev->tagsEccUnfixed++;
 
 	if (tags && retval == -EBADMSG && tags->eccResult != YAFFS_ECC_RESULT_UNFIXED) {
@@ -53,6 +53,23 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/*
+ * Data-only read for callers that do not hold the grossLock.  Reading no
+ * tags keeps clear of the shared spare buffer, and nothing is done about
+ * ECC errors since that changes block state: any error, even a corrected
+ * one, fails the read so the caller can repeat it with the lock held.
+ */
+int yaffs_ReadChunkDataFromNANDUnlocked(yaffs_Device *dev, int chunkInNAND,
+					__u8 *buffer)
+{
+	if (!dev->readChunkWithTagsFromNAND)
+		return YAFFS_FAIL;
+
+	return dev->readChunkWithTagsFromNAND(dev,
+					chunkInNAND - dev->chunkOffset,
+					buffer, NULL);
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
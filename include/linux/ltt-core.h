@@ -46,6 +46,24 @@ extern ltt_run_filter_functor ltt_run_filter;
 extern void ltt_filter_register(ltt_run_filter_functor func);
 extern void ltt_filter_unregister(void);
 
+/*
+ * Flight recorder snapshot trigger, implemented by the tracer. Can be called
+ * from any context; from_panic must be set only once the other CPUs have been
+ * stopped.
+ */
+typedef void (*ltt_snapshot_functor)(int from_panic);
+
+#ifdef CONFIG_LTT
+extern void ltt_snapshot_trigger(int from_panic);
+#else
+static inline void ltt_snapshot_trigger(int from_panic)
+{
+}
+#endif
+
+extern void ltt_snapshot_register(ltt_snapshot_functor func);
+extern void ltt_snapshot_unregister(void);
+
 #if defined(CONFIG_LTT) && defined(CONFIG_LTT_ALIGNMENT)
 
 /*
@@ -64,6 +64,98 @@ size_t ltt_serialize_data(struct ltt_chanbuf *buf, size_t buf_offset,
 			  void *serialize_private, int *largest_align,
 			  const char *fmt, va_list *args);
 
+enum ltt_type {
+	LTT_TYPE_SIGNED_INT,
+	LTT_TYPE_UNSIGNED_INT,
+	LTT_TYPE_STRING,
+	LTT_TYPE_NONE,
+};
+
+/* Maximum number of fields in a precompiled format */
+#define LTT_SERIALIZE_MAX_OPS	16
+/* Largest fixed-size payload serialized once on the stack */
+#define LTT_SERIALIZE_FIXED_MAX	64
+
+/*
+ * One field of a format compiled by ltt_serialize_compile(). offset is the
+ * position of the field in the payload, only valid for fixed formats.
+ */
+struct ltt_serialize_op {
+	unsigned char trace_size;
+	unsigned char trace_type;
+	unsigned char c_size;
+	unsigned char offset;
+};
+
+struct ltt_serialize_ops {
+	unsigned char compiled;		/* ops usable by ltt_vtrace */
+	unsigned char fixed;		/*
+					 * No strings and data_size at most
+					 * LTT_SERIALIZE_FIXED_MAX.
+					 */
+	unsigned char nr_ops;
+	unsigned short data_size;	/* payload size, if fixed */
+	int largest_align;
+	struct ltt_serialize_op op[LTT_SERIALIZE_MAX_OPS];
+};
+
+int ltt_serialize_compile(struct ltt_serialize_ops *ops, const char *fmt);
+
+/*
+ * Event filter, compiled by ltt-filter from an expression on the event fields
+ * and run by ltt_vtrace() before space is reserved. Instructions are in
+ * postfix order and evaluated on a stack of booleans.
+ */
+#define LTT_FILTER_MAX_INSNS	32
+#define LTT_FILTER_MAX_STRINGS	128
+
+enum ltt_filter_opcode {
+	LTT_FILTER_OP_TEST,		/* push the result of a field test */
+	LTT_FILTER_OP_NOT,
+	LTT_FILTER_OP_AND,
+	LTT_FILTER_OP_OR,
+};
+
+enum ltt_filter_field {
+	LTT_FILTER_FIELD_PID,
+	LTT_FILTER_FIELD_TGID,
+	LTT_FILTER_FIELD_CPU,
+	LTT_FILTER_FIELD_COMM,
+	LTT_FILTER_FIELD_ARG,		/* event field number arg */
+};
+
+enum ltt_filter_cmp {
+	LTT_FILTER_CMP_EQ,
+	LTT_FILTER_CMP_NE,
+	LTT_FILTER_CMP_LT,
+	LTT_FILTER_CMP_LE,
+	LTT_FILTER_CMP_GT,
+	LTT_FILTER_CMP_GE,
+	LTT_FILTER_CMP_STREQ,
+	LTT_FILTER_CMP_PREFIX,
+};
+
+struct ltt_filter_insn {
+	unsigned char op;
+	unsigned char field;
+	unsigned char cmp;
+	unsigned char arg;
+	unsigned char is_signed;
+	unsigned char str_len;
+	unsigned short str;		/* operand offset in strings */
+	long long imm;
+};
+
+struct ltt_filter {
+	unsigned int nr_insns;
+	unsigned int nr_args;		/* event fields to fetch */
+	struct ltt_filter_insn insn[LTT_FILTER_MAX_INSNS];
+	char strings[LTT_FILTER_MAX_STRINGS];
+};
+
+extern int ltt_filter_set(const char *channel, const char *name,
+			  const char *expr);
+
 struct ltt_available_probe {
 	const char *name;		/* probe name */
 	const char *format;
@@ -113,6 +205,8 @@ struct ltt_active_marker {
 	const char *name;
 	const char *format;
 	struct ltt_available_probe *probe;
+	struct ltt_serialize_ops ops;	/* compiled format, if any */
+	struct ltt_filter *filter;	/* RCU, NULL when unfiltered */
 };
 
 extern void ltt_vtrace(const struct marker *mdata, void *probe_data,
@@ -165,6 +259,8 @@ struct ltt_trace_ops {
 			       size_t n_sb, int overwrite,
 			       struct ltt_trace *trace);
 	void (*finish_channel) (struct ltt_chan *chan);
+	void (*snapshot_channel) (struct ltt_chan *chan);
+	void (*resume_channel) (struct ltt_chan *chan);
 	void (*remove_channel) (struct kref *kref);
 	void (*user_errors) (struct ltt_trace *trace, unsigned int index,
 			     size_t data_size, struct user_dbg_data *dbg,
@@ -212,6 +308,7 @@ struct ltt_trace {
 	struct ltt_transport *transport;
 	struct kref ltt_transport_kref;
 	wait_queue_head_t kref_wq; /* Place for ltt_trace_destroy to sleep */
+	int frozen;		/* Stopped by a snapshot, until resumed */
 	char trace_name[NAME_MAX];
 } ____cacheline_aligned;
 
@@ -623,6 +720,8 @@ int ltt_trace_alloc(const char *trace_name);
 int ltt_trace_destroy(const char *trace_name);
 int ltt_trace_start(const char *trace_name);
 int ltt_trace_stop(const char *trace_name);
+int ltt_trace_snapshot(const char *trace_name);
+int ltt_trace_snapshot_resume(const char *trace_name);
 
 extern int ltt_control(enum ltt_control_msg msg, const char *trace_name,
 		       const char *trace_type, union ltt_control_args args);
@@ -0,0 +1,40 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Kernel Interface
+ *
+ *  A fast LZ77-class compressor producing the LZ4 block format:
+ *  a sequence of (token, literals, 16-bit offset, match length)
+ *  tuples with the last five bytes always stored as literals.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_worst_compress(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'workmem' of size LZ4_MEM_COMPRESS.
+ * *dst_len is the size of dst on entry and the compressed size on
+ * return; compression fails if the output does not fit.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK			0
+#define LZ4_E_OUTPUT_OVERRUN		(-1)
+#define LZ4_E_INPUT_OVERRUN		(-2)
+#define LZ4_E_LOOKBEHIND_OVERRUN	(-3)
+
+#endif
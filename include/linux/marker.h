@@ -239,6 +239,7 @@ extern void *marker_get_private_data(const char *channel, const char *name,
 
 const char *marker_get_name_from_id(u16 channel_id, u16 event_id);
 const char *marker_get_fmt_from_id(u16 channel_id, u16 event_id);
+const char *marker_get_fmt(const char *channel, const char *name);
 
 /*
  * marker_synchronize_unregister must be called between the last marker probe
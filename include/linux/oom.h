@@ -10,10 +10,12 @@
 #ifdef __KERNEL__
 
 #include <linux/types.h>
+#include <linux/list.h>
 #include <linux/nodemask.h>
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -47,5 +49,43 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_OOM_ADJ_INDEX
+/*
+ * Thread group leaders hashed by oom_adj, from OOM_DISABLE up to
+ * OOM_ADJUST_MAX.  Protected by tasklist_lock.
+ */
+#define OOM_ADJ_INDEX_SIZE	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+extern struct hlist_head oom_adj_index[OOM_ADJ_INDEX_SIZE];
+
+static inline struct hlist_head *oom_adj_bucket(int oom_adj)
+{
+	return &oom_adj_index[oom_adj - OOM_DISABLE];
+}
+
+extern void oom_adj_index_add(struct task_struct *p);
+extern void oom_adj_index_del(struct task_struct *p);
+extern void oom_adj_index_replace(struct task_struct *old,
+				  struct task_struct *new);
+extern void oom_adj_index_update(struct task_struct *p);
+#else
+static inline void oom_adj_index_add(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_index_del(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_index_replace(struct task_struct *old,
+					 struct task_struct *new)
+{
+}
+
+static inline void oom_adj_index_update(struct task_struct *p)
+{
+}
+#endif /* CONFIG_OOM_ADJ_INDEX */
+
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
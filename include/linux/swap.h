@@ -262,6 +262,12 @@ extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
 
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+extern int isolate_lru_page_compcache(struct page *page);
+extern unsigned long zone_id_shrink_pagelist(struct zone *zone,
+					     struct list_head *page_list);
+#endif
+
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
 extern int sysctl_min_unmapped_ratio;
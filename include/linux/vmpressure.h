@@ -0,0 +1,36 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/gfp.h>
+#include <linux/notifier.h>
+
+/*
+ * How hard reclaim has to work, from the ratio of reclaimed to scanned
+ * pages.  Listeners are called with the level as the event and the
+ * pressure, in percent, as the data pointer.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, int prio);
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+
+static inline void vmpressure_prio(gfp_t gfp, int prio)
+{
+}
+#endif /* CONFIG_VMPRESSURE */
+
+#endif /* __LINUX_VMPRESSURE_H */
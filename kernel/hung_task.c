@@ -15,6 +15,7 @@
 #include <linux/lockdep.h>
 #include <linux/module.h>
 #include <linux/sysctl.h>
+#include <linux/ltt-core.h>
 
 /*
  * The number of tasks checked:
@@ -102,6 +103,9 @@ static void check_hung_task(struct task_struct *t, unsigned long timeout)
 
 	touch_nmi_watchdog();
 
+	/* Keep the trace of what led to the hang */
+	ltt_snapshot_trigger(0);
+
 	if (sysctl_hung_task_panic)
 		panic("hung_task: blocked tasks");
 }
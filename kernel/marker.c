@@ -1072,6 +1072,17 @@ const char *marker_get_fmt_from_id(u16 channel_id, u16 event_id)
 }
 EXPORT_SYMBOL_GPL(marker_get_fmt_from_id);
 
+/*
+ * Returns the format of marker channel.name, or NULL if neither the marker nor
+ * a probe has declared it yet. Must be called with lock_markers() held.
+ */
+const char *marker_get_fmt(const char *channel, const char *name)
+{
+	struct marker_entry *e = get_marker(channel, name);
+	return e ? e->format : NULL;
+}
+EXPORT_SYMBOL_GPL(marker_get_fmt);
+
 /**
  * markers_compact_event_ids - Compact markers event IDs and reassign channels
  *
@@ -0,0 +1,243 @@
+/*
+ * kernel/trace/trace-clock-32-to-64.c
+ *
+ * Extends a free-running trace clock of TC_HW_BITS bits to 64 bits.
+ *
+ * Each CPU keeps, in one of two slots, the last 64-bit value computed and the
+ * hardware count it was computed at. A per-cpu timer, firing more often than
+ * the hardware count wraps, fills the slot not in use from the current one and
+ * then flips the index. Readers run with preemption disabled on the CPU owning
+ * the slots, so the slot they picked can only be overwritten if they are
+ * interrupted for two whole update periods: no lock and no atomic operation on
+ * the read side.
+ *
+ * The hardware clock is expected to be shared by all CPUs (or synchronized):
+ * each CPU extends it from the same reference, so the 64-bit values are
+ * comparable across CPUs.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/trace-clock.h>
+#include <asm/div64.h>
+
+#define HW_BITMASK	((u32)((1ULL << TC_HW_BITS) - 1))
+
+struct synthetic_tsc_slot {
+	u64 val;		/* 64-bit trace clock value at hw */
+	u32 hw;			/* hardware count val was computed at */
+};
+
+struct synthetic_tsc_struct {
+	struct synthetic_tsc_slot tsc[2];
+	unsigned int index;	/* slot read by the readers */
+};
+
+static DEFINE_PER_CPU(struct synthetic_tsc_struct, synthetic_tsc);
+static DEFINE_PER_CPU(struct timer_list, tsc_timer);
+
+static DEFINE_MUTEX(synthetic_tsc_mutex);
+static int synthetic_tsc_refcount;	/* Number of readers */
+static unsigned long precalc_expire;	/* Update period, in jiffies */
+
+#ifdef CONFIG_DEBUG_TRACE_CLOCK
+static DEFINE_PER_CPU(u64, last_synthetic_tsc);
+#endif
+
+static inline u64 synthetic_tsc_extend(const struct synthetic_tsc_slot *slot,
+				       u32 hw)
+{
+	return slot->val + ((hw - slot->hw) & HW_BITMASK);
+}
+
+/*
+ * Compute a new reference for the local CPU. Called from the update timer
+ * and from IPIs, the only writers of the local slots.
+ */
+static notrace void update_synthetic_tsc(void)
+{
+	struct synthetic_tsc_struct *cpu_synth;
+	unsigned long flags;
+	unsigned int next;
+	u32 hw;
+
+	local_irq_save(flags);
+	cpu_synth = &per_cpu(synthetic_tsc, smp_processor_id());
+	next = 1 - cpu_synth->index;
+	hw = trace_clock_read32();
+	cpu_synth->tsc[next].val =
+		synthetic_tsc_extend(&cpu_synth->tsc[cpu_synth->index], hw);
+	cpu_synth->tsc[next].hw = hw;
+	barrier();	/* Write the slot before readers can pick it */
+	cpu_synth->index = next;
+	local_irq_restore(flags);
+}
+
+notrace u64 trace_clock_read_synthetic_tsc(void)
+{
+	struct synthetic_tsc_struct *cpu_synth;
+	unsigned int index;
+	u64 val;
+#ifdef CONFIG_DEBUG_TRACE_CLOCK
+	unsigned long flags;
+
+	/* Nested readers would make the check below see time go backward */
+	local_irq_save(flags);
+#endif
+
+	preempt_disable_notrace();
+	cpu_synth = &per_cpu(synthetic_tsc, smp_processor_id());
+	index = ACCESS_ONCE(cpu_synth->index);
+	barrier();	/* Pick the slot before reading the hardware clock */
+	val = synthetic_tsc_extend(&cpu_synth->tsc[index],
+				   trace_clock_read32());
+#ifdef CONFIG_DEBUG_TRACE_CLOCK
+	WARN_ON_ONCE(val < __get_cpu_var(last_synthetic_tsc));
+	__get_cpu_var(last_synthetic_tsc) = val;
+#endif
+	preempt_enable_notrace();
+
+#ifdef CONFIG_DEBUG_TRACE_CLOCK
+	local_irq_restore(flags);
+#endif
+	return val;
+}
+EXPORT_SYMBOL_GPL(trace_clock_read_synthetic_tsc);
+
+static void synthetic_tsc_timer_fct(unsigned long data)
+{
+	update_synthetic_tsc();
+	mod_timer_pinned(&per_cpu(tsc_timer, smp_processor_id()),
+			 jiffies + precalc_expire);
+}
+
+/*
+ * Start a CPU from the reference of the calling CPU. Runs on the target CPU,
+ * with interrupts off.
+ */
+static void init_synthetic_tsc_ipi(void *info)
+{
+	struct synthetic_tsc_slot *ref = info;
+	struct synthetic_tsc_struct *cpu_synth;
+	u32 hw;
+
+	cpu_synth = &per_cpu(synthetic_tsc, smp_processor_id());
+	hw = trace_clock_read32();
+	cpu_synth->tsc[0].val = synthetic_tsc_extend(ref, hw);
+	cpu_synth->tsc[0].hw = hw;
+	barrier();
+	cpu_synth->index = 0;
+#ifdef CONFIG_DEBUG_TRACE_CLOCK
+	__get_cpu_var(last_synthetic_tsc) = 0;
+#endif
+}
+
+static void enable_synthetic_tsc(int cpu, struct synthetic_tsc_slot *ref)
+{
+	smp_call_function_single(cpu, init_synthetic_tsc_ipi, ref, 1);
+	setup_timer(&per_cpu(tsc_timer, cpu), synthetic_tsc_timer_fct, 0);
+	per_cpu(tsc_timer, cpu).expires = jiffies + precalc_expire;
+	add_timer_on(&per_cpu(tsc_timer, cpu), cpu);
+}
+
+static void disable_synthetic_tsc(int cpu)
+{
+	del_timer_sync(&per_cpu(tsc_timer, cpu));
+}
+
+/*
+ * Update at half the wrap period, minus the worst interrupt latency we
+ * expect, so that an update is never more than one wrap late.
+ */
+static void precalc_stsc_interval(void)
+{
+	u64 wrap_ms = (u64)HW_BITMASK * MSEC_PER_SEC;
+
+	do_div(wrap_ms, trace_clock_frequency());
+	wrap_ms >>= 1;
+	if (wrap_ms > TC_EXPECTED_INTERRUPT_LATENCY)
+		wrap_ms -= TC_EXPECTED_INTERRUPT_LATENCY;
+	precalc_expire = max(msecs_to_jiffies(wrap_ms), 1UL);
+}
+
+static int __cpuinit hotcpu_callback(struct notifier_block *nb,
+				     unsigned long action, void *hcpu)
+{
+	unsigned int hotcpu = (unsigned long)hcpu;
+	struct synthetic_tsc_struct *cpu_synth;
+	struct synthetic_tsc_slot ref;
+
+	mutex_lock(&synthetic_tsc_mutex);
+	if (!synthetic_tsc_refcount)
+		goto end;
+
+	switch (action) {
+	case CPU_ONLINE:
+	case CPU_ONLINE_FROZEN:
+		cpu_synth = &get_cpu_var(synthetic_tsc);
+		ref = cpu_synth->tsc[ACCESS_ONCE(cpu_synth->index)];
+		put_cpu_var(synthetic_tsc);
+		enable_synthetic_tsc(hotcpu, &ref);
+		break;
+#ifdef CONFIG_HOTPLUG_CPU
+	case CPU_DEAD:
+	case CPU_DEAD_FROZEN:
+		disable_synthetic_tsc(hotcpu);
+		break;
+#endif /* CONFIG_HOTPLUG_CPU */
+	}
+end:
+	mutex_unlock(&synthetic_tsc_mutex);
+	return NOTIFY_OK;
+}
+
+void get_synthetic_tsc(void)
+{
+	struct synthetic_tsc_slot ref;
+	int cpu;
+
+	get_online_cpus();
+	mutex_lock(&synthetic_tsc_mutex);
+	if (synthetic_tsc_refcount++)
+		goto end;
+
+	precalc_stsc_interval();
+	ref.hw = trace_clock_read32();
+	ref.val = ref.hw;
+	for_each_online_cpu(cpu)
+		enable_synthetic_tsc(cpu, &ref);
+end:
+	mutex_unlock(&synthetic_tsc_mutex);
+	put_online_cpus();
+}
+EXPORT_SYMBOL_GPL(get_synthetic_tsc);
+
+void put_synthetic_tsc(void)
+{
+	int cpu;
+
+	get_online_cpus();
+	mutex_lock(&synthetic_tsc_mutex);
+	WARN_ON(synthetic_tsc_refcount <= 0);
+	if (--synthetic_tsc_refcount)
+		goto end;
+
+	for_each_online_cpu(cpu)
+		disable_synthetic_tsc(cpu);
+end:
+	mutex_unlock(&synthetic_tsc_mutex);
+	put_online_cpus();
+}
+EXPORT_SYMBOL_GPL(put_synthetic_tsc);
+
+static int __init init_synthetic_tsc(void)
+{
+	hotcpu_notifier(hotcpu_callback, 4);
+	return 0;
+}
+early_initcall(init_synthetic_tsc);
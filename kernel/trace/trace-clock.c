@@ -0,0 +1,36 @@
+/*
+ * kernel/trace/trace-clock.c
+ *
+ * Generic trace clock, for architectures without a specialized one: a
+ * logical clock incremented on each read, extended to 64 bits on 32-bit
+ * architectures.
+ */
+
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/trace-clock.h>
+
+atomic_long_t trace_clock_var;
+EXPORT_SYMBOL(trace_clock_var);
+
+static DEFINE_MUTEX(trace_clock_mutex);
+static int trace_clock_refcount;
+
+void get_trace_clock(void)
+{
+	mutex_lock(&trace_clock_mutex);
+	if (!trace_clock_refcount++)
+		get_synthetic_tsc();
+	mutex_unlock(&trace_clock_mutex);
+}
+EXPORT_SYMBOL_GPL(get_trace_clock);
+
+void put_trace_clock(void)
+{
+	mutex_lock(&trace_clock_mutex);
+	WARN_ON(trace_clock_refcount <= 0);
+	if (!--trace_clock_refcount)
+		put_synthetic_tsc();
+	mutex_unlock(&trace_clock_mutex);
+}
+EXPORT_SYMBOL_GPL(put_trace_clock);
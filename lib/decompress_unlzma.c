@@ -38,6 +38,12 @@
 
 #include <linux/decompress/mm.h>
 
+#if !defined(PREBOOT) && defined(CONFIG_DECOMPRESS_LZMA_NEEDED)
+#include <linux/module.h>
+#undef INIT
+#define INIT
+#endif
+
 #define	MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 static long long INIT read_int(unsigned char *ptr, int size)
@@ -653,6 +659,10 @@ exit_0:
 	return ret;
 }
 
+#if !defined(PREBOOT) && defined(CONFIG_DECOMPRESS_LZMA_NEEDED)
+EXPORT_SYMBOL(unlzma);
+#endif
+
 #ifdef PREBOOT
 STATIC int INIT decompress(unsigned char *buf, int in_len,
 			      int(*fill)(void*, unsigned int),
@@ -0,0 +1,168 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Greedy single-pass compressor with a 4K-entry hash table of
+ *  positions. Candidate positions are bounds-checked and verified
+ *  against the input, so the table does not need to be cleared
+ *  between calls.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Hash little-endian so the output does not depend on the host */
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned_le32(p) * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/*
+ * Look up and replace the table entry for ip. Entries left by previous
+ * calls, or never written, are only used if they point before ip within
+ * the match distance, so that the candidate lies in the current input.
+ */
+static inline const unsigned char *lz4_find_ref(u32 *table,
+		const unsigned char *src, const unsigned char *ip)
+{
+	u32 h = lz4_hash(ip);
+	size_t pos = ip - src;
+	size_t ref = table[h];
+
+	table[h] = pos;
+	if (ref >= pos || pos - ref > LZ4_MAX_DISTANCE)
+		return NULL;
+	return src + ref;
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 * const table = wrkmem;
+	const unsigned char * const in_end = src + src_len;
+	const unsigned char * const mf_limit = in_end - LZ4_MF_LIMIT;
+	const unsigned char * const match_limit = in_end - LZ4_LAST_LITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char * const out_end = dst + *dst_len;
+	unsigned char *op = dst, *token;
+	size_t len;
+
+	if (src_len < LZ4_MIN_LENGTH)
+		goto last_literals;
+
+	for (;;) {
+		unsigned int step = 1;
+		unsigned int search = 1 << LZ4_SKIP_TRIGGER;
+
+		/* Find a match, skipping faster through incompressible data */
+		for (;;) {
+			if (ip > mf_limit)
+				goto last_literals;
+
+			ref = lz4_find_ref(table, src, ip);
+			if (ref && LZ4_READ32(ref) == LZ4_READ32(ip))
+				break;
+
+			ip += step;
+			step = search++ >> LZ4_SKIP_TRIGGER;
+		}
+
+		/* Extend the match backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Literal run */
+		len = ip - anchor;
+		token = op++;
+		if (unlikely(op + len + len / 255 + 3 + LZ4_LAST_LITERALS >
+			     out_end))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		if (len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, len - RUN_MASK);
+		} else
+			*token = len << ML_BITS;
+
+		memcpy(op, anchor, len);
+		op += len;
+
+next_match:
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* Match length */
+		ip += LZ4_MIN_MATCH;
+		ref += LZ4_MIN_MATCH;
+		anchor = ip;
+		while (ip < match_limit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor;
+		if (unlikely(op + len / 255 + 1 + LZ4_LAST_LITERALS > out_end))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else
+			*token += len;
+
+		anchor = ip;
+		if (ip > mf_limit)
+			break;
+
+		table[lz4_hash(ip - 2)] = ip - 2 - src;
+
+		/* A match right at the end of the last one needs no literals */
+		ref = lz4_find_ref(table, src, ip);
+		if (ref && LZ4_READ32(ref) == LZ4_READ32(ip)) {
+			token = op++;
+			*token = 0;
+			goto next_match;
+		}
+
+		ip++;
+	}
+
+last_literals:
+	len = in_end - anchor;
+	if (unlikely(op + 1 + len + (len + 255 - RUN_MASK) / 255 > out_end))
+		return LZ4_E_OUTPUT_OVERRUN;
+
+	if (len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else
+		*op++ = len << ML_BITS;
+
+	memcpy(op, anchor, len);
+	op += len;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
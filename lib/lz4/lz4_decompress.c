@@ -0,0 +1,111 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Every length, offset and copy is checked against the input and
+ *  output bounds, so corrupted input cannot overrun either buffer.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Add the 255-terminated extension bytes of a length, bounded by limit */
+static inline int lz4_get_length(const unsigned char **ip,
+		const unsigned char *in_end, size_t *len, size_t limit)
+{
+	unsigned int s;
+
+	do {
+		if (unlikely(*ip >= in_end))
+			return LZ4_E_INPUT_OVERRUN;
+		s = *(*ip)++;
+		*len += s;
+		if (unlikely(*len > limit))
+			return LZ4_E_OUTPUT_OVERRUN;
+	} while (s == 255);
+
+	return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const in_end = src + src_len;
+	unsigned char *op = dst;
+	unsigned char * const out_end = dst + *dst_len;
+	const unsigned char *ref;
+	unsigned int token;
+	size_t len, offset;
+	int ret;
+
+	while (ip < in_end) {
+		token = *ip++;
+
+		/* Literal run */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			ret = lz4_get_length(&ip, in_end, &len, out_end - op);
+			if (ret)
+				return ret;
+		}
+		if (unlikely(len > (size_t)(in_end - ip)))
+			return LZ4_E_INPUT_OVERRUN;
+		if (unlikely(len > (size_t)(out_end - op)))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence carries literals only */
+		if (ip == in_end)
+			break;
+
+		if (unlikely(in_end - ip < 2))
+			return LZ4_E_INPUT_OVERRUN;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > (size_t)(op - dst)))
+			return LZ4_E_LOOKBEHIND_OVERRUN;
+		ref = op - offset;
+
+		/* Match copy; source and destination may overlap */
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			ret = lz4_get_length(&ip, in_end, &len, out_end - op);
+			if (ret)
+				return ret;
+		}
+		len += LZ4_MIN_MATCH;
+		if (unlikely(len > (size_t)(out_end - op)))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else if (offset >= 8) {
+			for (; len >= 8; len -= 8, op += 8, ref += 8)
+				memcpy(op, ref, 8);
+			while (len--)
+				*op++ = *ref++;
+		} else {
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
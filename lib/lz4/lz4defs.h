@@ -0,0 +1,21 @@
+/*
+ *  lz4defs.h -- LZ4 block format definitions
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MF_LIMIT		12	/* last match starts this far from end */
+#define LZ4_MIN_LENGTH		(LZ4_MF_LIMIT + 1)
+#define LZ4_MAX_DISTANCE	0xffff
+#define LZ4_SKIP_TRIGGER	6
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define LZ4_READ32(p)	get_unaligned((const u32 *)(p))
@@ -24,9 +24,6 @@
  * This timer will insure that we periodically have subbuffers to read, and
  * therefore that the merge-sort does not wait endlessly for a subbuffer.
  *
- * - If a channel is switched and read without data, make sure it is still
- * considered afterward (not removed from the queue).
- *
  * - Create a ascii/tracename/ALL file to merge-sort all active channels.
  * - Create a ascii/tracename/README file to contain the text output legend.
  * - Remove leading zeroes from timestamps.
@@ -41,13 +38,14 @@
 #include <linux/module.h>
 #include <linux/ltt-tracer.h>
 #include <linux/ltt-relay.h>
-#include <linux/seq_file.h>
 #include <linux/debugfs.h>
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/cpu.h>
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
 
 #include "ltt-relay-select.h"
 
@@ -60,6 +58,18 @@
 struct dentry *ltt_ascii_dir_dentry;
 EXPORT_SYMBOL_GPL(ltt_ascii_dir_dentry);
 
+/*
+ * Event names and formats looked up during one page fill. Looking them up
+ * takes the markers mutex, so it is only done once per event type and page.
+ */
+#define LTT_ASCII_TYPE_CACHE	64
+
+struct ltt_ascii_event_type {
+	const char *name;
+	const char *fmt;
+	u16 eID;
+};
+
 struct ltt_relay_iter;
 
 struct ltt_relay_cpu_iter {
@@ -67,6 +77,7 @@ struct ltt_relay_cpu_iter {
 	struct ltt_chanbuf *buf;
 	struct ltt_relay_iter *iter;
 	int sb_ref;		/* holding a reference to a subbuffer */
+	int wait_sb;		/* waiting for the next subbuffer */
 	long read_sb_offset;	/* offset of the subbuffer read */
 
 	/* current event information */
@@ -79,12 +90,25 @@ struct ltt_relay_cpu_iter {
 	u16 eID;
 };
 
+/*
+ * The cpu iterators holding a subbuffer are kept in a min-heap ordered by the
+ * timestamp of their current event, so that merging n cpus costs O(log n) per
+ * event. Iterators waiting for their next subbuffer are out of the heap: no
+ * event can be output until they get it, or their buffer is finalized.
+ */
 struct ltt_relay_iter {
 	struct ltt_relay_cpu_iter iter_cpu[NR_CPUS];
+	struct ltt_relay_cpu_iter *heap[NR_CPUS];
+	int heap_size;
+	int nr_waiting;		/* cpu iterators waiting for a subbuffer */
 	struct ltt_chan *chan;
-	loff_t pos;
-	int cpu;
 	int nr_refs;
+
+	struct mutex lock;	/* serializes readers */
+	char *page;		/* formatted events */
+	size_t len;		/* length of text in page */
+	size_t read_pos;	/* text already copied to user space */
+	struct ltt_ascii_event_type types[LTT_ASCII_TYPE_CACHE];
 };
 
 /*
@@ -97,7 +121,7 @@ static int is_subbuffer_offset_end(struct ltt_relay_cpu_iter *citer,
 					     struct ltt_chan, a);
 	long sub_offset = SUBBUF_OFFSET(offset - 1, chan) + 1;
 
-	return (sub_offset <= citer->header->data_size);
+	return (sub_offset >= citer->header->data_size);
 }
 
 static u64 calculate_tsc(u64 pre_tsc, u64 read_tsc, unsigned int rflags)
@@ -115,16 +139,31 @@ static u64 calculate_tsc(u64 pre_tsc, u64 read_tsc, unsigned int rflags)
 	return new_tsc;
 }
 
+static const struct ltt_ascii_event_type *
+ltt_ascii_get_type(struct ltt_relay_iter *iter, u16 chID, u16 eID)
+{
+	struct ltt_ascii_event_type *type;
+
+	type = &iter->types[eID % LTT_ASCII_TYPE_CACHE];
+	if (!type->fmt || type->eID != eID) {
+		type->name = marker_get_name_from_id(chID, eID);
+		type->fmt = marker_get_fmt_from_id(chID, eID);
+		type->eID = eID;
+	}
+	return type;
+}
+
 /*
  * calculate payload offset */
-static inline long calculate_payload_offset(long offset, u16 chID, u16 eID)
+static inline long calculate_payload_offset(struct ltt_relay_iter *iter,
+					    long offset, u16 chID, u16 eID)
 {
 	const char *fmt;
 
 	if (!ltt_get_alignment())
 		return offset;
 
-	fmt = marker_get_fmt_from_id(chID, eID);
+	fmt = ltt_ascii_get_type(iter, chID, eID)->fmt;
 	BUG_ON(!fmt);
 
 	return offset + ltt_fmt_largest_align(offset, fmt);
@@ -141,7 +180,8 @@ static void update_new_event(struct ltt_relay_cpu_iter *citer, long hdr_offset)
 	tmp_offset = ltt_read_event_header(&citer->buf->a, hdr_offset,
 					   &read_tsc, &citer->data_size,
 					   &citer->eID, &rflags);
-	citer->payload_offset = calculate_payload_offset(tmp_offset,
+	citer->payload_offset = calculate_payload_offset(citer->iter,
+							 tmp_offset,
 							 citer->chID,
 							 citer->eID);
 
@@ -157,7 +197,7 @@ static void update_event_size(struct ltt_relay_cpu_iter *citer, long hdr_offset)
 	if (citer->data_size != INT_MAX)
 		return;
 
-	fmt = marker_get_fmt_from_id(citer->chID, citer->eID);
+	fmt = ltt_ascii_get_type(citer->iter, citer->chID, citer->eID)->fmt;
 	BUG_ON(!fmt);
 	ltt_serialize_printf(citer->buf, citer->payload_offset,
 			     &data_size, output, 0, fmt);
@@ -214,172 +254,245 @@ static void subbuffer_stop(struct ltt_relay_cpu_iter *citer,
 	iter->nr_refs--;
 }
 
-static void ltt_relay_advance_cpu_iter(struct ltt_relay_cpu_iter *citer)
+static void heap_swap(struct ltt_relay_iter *iter, int a, int b)
 {
-	long old_offset = citer->payload_offset;
-	long new_offset = citer->payload_offset;
-	int ret;
-
-	/* find that whether we read all data in this subbuffer */
-	if (unlikely(is_subbuffer_offset_end(citer,
-					     old_offset + citer->data_size))) {
-		DEBUGP(KERN_DEBUG "LTT ASCII stop cpu %d offset %lX\n",
-		       citer->buf->a.cpu, citer->read_sb_offset);
-		subbuffer_stop(citer, citer->read_sb_offset);
-		for (;;) {
-			ret = subbuffer_start(citer, &citer->read_sb_offset);
-			DEBUGP(KERN_DEBUG
-			       "LTT ASCII start cpu %d ret %d offset %lX\n",
-			       citer->buf->a.cpu, ret, citer->read_sb_offset);
-			if (!ret || ret == -ENODATA) {
-				break;	/* got data, or finalized */
-			} else {	/* -EAGAIN */
-				if (signal_pending(current))
-					break;
-				schedule_timeout_interruptible(1);
-				//TODO: check for no-data delay. take ref. break
-			}
-		}
-	} else {
-		new_offset += citer->data_size;
-		citer->hdr_offset = new_offset + ltt_align(new_offset, sizeof(struct ltt_event_header));
-		DEBUGP(KERN_DEBUG
-		       "LTT ASCII old_offset %lX new_offset %lX cpu %d\n",
-		       old_offset, new_offset, citer->buf->a.cpu);
-	}
+	struct ltt_relay_cpu_iter *tmp = iter->heap[a];
 
-	update_cpu_iter(citer, citer->hdr_offset);
+	iter->heap[a] = iter->heap[b];
+	iter->heap[b] = tmp;
 }
 
-static int cpu_iter_eof(struct ltt_relay_cpu_iter *citer)
+static void heap_up(struct ltt_relay_iter *iter, int i)
 {
-	return !citer->sb_ref;
-}
+	while (i > 0) {
+		int parent = (i - 1) / 2;
 
-static int ltt_relay_iter_eof(struct ltt_relay_iter *iter)
-{
-	return iter->nr_refs == 0;
+		if (iter->heap[parent]->tsc <= iter->heap[i]->tsc)
+			break;
+		heap_swap(iter, parent, i);
+		i = parent;
+	}
 }
 
-static void ltt_relay_advance_iter(struct ltt_relay_iter *iter)
+static void heap_down(struct ltt_relay_iter *iter, int i)
 {
-	int i;
-	struct ltt_relay_cpu_iter *curr, *min = NULL;
-	iter->cpu = -1;
-
-	/*
-	 * find the event with the minimum tsc.
-	 * TODO: use min-heep for 4096CPUS
-	 */
-	for_each_possible_cpu(i) {
-		curr = &iter->iter_cpu[i];
-
-		if (!curr->buf->a.allocated || !curr->header)
-			continue;
-
-		if (cpu_iter_eof(curr))
-			continue;
-
-		if (!min || curr->tsc < min->tsc) {
-			min = curr;
-			iter->cpu = i;
-		}
+	for (;;) {
+		int min = i, child = 2 * i + 1;
+
+		if (child < iter->heap_size
+		    && iter->heap[child]->tsc < iter->heap[min]->tsc)
+			min = child;
+		child++;
+		if (child < iter->heap_size
+		    && iter->heap[child]->tsc < iter->heap[min]->tsc)
+			min = child;
+		if (min == i)
+			break;
+		heap_swap(iter, min, i);
+		i = min;
 	}
-
-	/* update cpu_iter for next ltt_relay_advance_iter() */
-	if (min)
-		ltt_relay_advance_cpu_iter(min);
 }
 
-static void *ascii_next(struct seq_file *m, void *v, loff_t *ppos)
+static void heap_insert(struct ltt_relay_iter *iter,
+			struct ltt_relay_cpu_iter *citer)
 {
-	struct ltt_relay_iter *iter = m->private;
-
-	WARN_ON_ONCE(!iter->nr_refs);
-	BUG_ON(v != iter);
-
-	ltt_relay_advance_iter(iter);
-	return (ltt_relay_iter_eof(iter) || signal_pending(current))
-		? NULL : iter;
+	iter->heap[iter->heap_size] = citer;
+	heap_up(iter, iter->heap_size++);
 }
 
-static void *ascii_start(struct seq_file *m, loff_t *ppos)
+static void heap_remove_top(struct ltt_relay_iter *iter)
 {
-	struct ltt_relay_iter *iter = m->private;
-
-	ltt_relay_advance_iter(iter);
-	return (ltt_relay_iter_eof(iter) || signal_pending(current))
-		? NULL : iter;
+	iter->heap[0] = iter->heap[--iter->heap_size];
+	heap_down(iter, 0);
 }
 
-static void ascii_stop(struct seq_file *m, void *v)
+static void cpu_iter_wait_subbuffer(struct ltt_relay_cpu_iter *citer)
 {
+	citer->header = NULL;
+	citer->wait_sb = 1;
+	citer->iter->nr_waiting++;
 }
 
-static
-int seq_serialize(struct seq_file *m, struct ltt_chanbuf *buf,
-		  size_t buf_offset, const char *fmt, size_t *data_size)
+/*
+ * Move the cpu iterator at the top of the heap to its next event. When the
+ * subbuffer has been read entirely, it is released and the iterator leaves the
+ * heap until ltt_relay_iter_get_subbufs() gets it the next one.
+ */
+static void ltt_relay_advance_cpu_iter(struct ltt_relay_iter *iter)
 {
-	int len;
-
-	if (m->count < m->size) {
-		len = ltt_serialize_printf(buf, buf_offset, data_size,
-					   m->buf + m->count,
-					   m->size - m->count, fmt);
-		if (m->count + len < m->size) {
-			m->count += len;
-			return 0;
+	struct ltt_relay_cpu_iter *citer = iter->heap[0];
+	long new_offset = citer->payload_offset + citer->data_size;
+
+	if (likely(!is_subbuffer_offset_end(citer, new_offset))) {
+		citer->hdr_offset = new_offset
+			+ ltt_align(new_offset, sizeof(struct ltt_event_header));
+		DEBUGP(KERN_DEBUG "LTT ASCII new_offset %lX cpu %d\n",
+		       new_offset, citer->buf->a.cpu);
+		update_cpu_iter(citer, citer->hdr_offset);
+		if (likely(citer->header)) {
+			heap_down(iter, 0);
+			return;
 		}
 	}
 
-	m->count = m->size;
-	return -1;
+	DEBUGP(KERN_DEBUG "LTT ASCII stop cpu %d offset %lX\n",
+	       citer->buf->a.cpu, citer->read_sb_offset);
+	subbuffer_stop(citer, citer->read_sb_offset);
+	heap_remove_top(iter);
+	cpu_iter_wait_subbuffer(citer);
 }
 
-static int ascii_show(struct seq_file *m, void *v)
+/*
+ * Get a subbuffer for each cpu iterator waiting for one, and put it back in
+ * the heap. Empty subbuffers are skipped. Returns -EAGAIN if a buffer has no
+ * subbuffer ready and we must not block, -EINTR if interrupted by a signal
+ * while waiting.
+ */
+static int ltt_relay_iter_get_subbufs(struct ltt_relay_iter *iter, int block)
 {
-	struct ltt_relay_iter *iter = v;
-	struct ltt_relay_cpu_iter *citer;
-	const char *name;
-	const char *fmt;
-	unsigned long long tsc;
-	size_t data_size;
+	int i, ret;
 
-	if (iter->cpu == -1)
+	if (likely(!iter->nr_waiting))
 		return 0;
 
-	citer = &iter->iter_cpu[iter->cpu];
-	WARN_ON_ONCE(!citer->sb_ref);
-	/*
-	 * Nothing to show, we are at the end of the last subbuffer currently
-	 * having data.
-	 */
-	if (!citer->header)
-		return 0;
+	for_each_possible_cpu(i) {
+		struct ltt_relay_cpu_iter *citer = &iter->iter_cpu[i];
+
+		while (citer->wait_sb) {
+			ret = subbuffer_start(citer, &citer->read_sb_offset);
+			DEBUGP(KERN_DEBUG
+			       "LTT ASCII start cpu %d ret %d offset %lX\n",
+			       citer->buf->a.cpu, ret, citer->read_sb_offset);
+			if (ret == -EAGAIN) {
+				if (!block)
+					return -EAGAIN;
+				if (signal_pending(current))
+					return -EINTR;
+				schedule_timeout_interruptible(1);
+				continue;
+			}
+			if (ret == -ENODATA) {
+				/* finalized */
+				citer->wait_sb = 0;
+				iter->nr_waiting--;
+				break;
+			}
+			update_cpu_iter(citer, citer->hdr_offset);
+			if (!citer->header) {
+				/* switched without data */
+				subbuffer_stop(citer, citer->read_sb_offset);
+				continue;
+			}
+			citer->wait_sb = 0;
+			iter->nr_waiting--;
+			heap_insert(iter, citer);
+		}
+	}
+	return 0;
+}
 
-	tsc = citer->tsc;
-	name = marker_get_name_from_id(citer->chID, citer->eID);
-	fmt = marker_get_fmt_from_id(citer->chID, citer->eID);
+/*
+ * Format the current event of citer into out. Returns the length of the
+ * line, 0 if the event is unknown and skipped, or -ENOSPC if the line does
+ * not fit in outlen.
+ */
+static int ltt_ascii_format_event(struct ltt_relay_iter *iter,
+				  struct ltt_relay_cpu_iter *citer,
+				  char *out, size_t outlen)
+{
+	const struct ltt_ascii_event_type *type;
+	size_t data_size;
+	size_t len;
 
-	if (!name || !fmt)
+	type = ltt_ascii_get_type(iter, citer->chID, citer->eID);
+	if (!type->name || !type->fmt)
 		return 0;
 
-	seq_printf(m, "event:%16.16s: cpu:%2d time:%20.20llu ",
-		   name, iter->cpu, tsc);
-	seq_serialize(m, citer->buf, citer->payload_offset, fmt, &data_size);
-	seq_puts(m, "\n");
+	len = snprintf(out, outlen, "event:%16.16s: cpu:%2d time:%20.20llu ",
+		       type->name, citer->buf->a.cpu,
+		       (unsigned long long)citer->tsc);
+	if (len >= outlen)
+		return -ENOSPC;
+	len += ltt_serialize_printf(citer->buf, citer->payload_offset,
+				    &data_size, out + len, outlen - len,
+				    type->fmt);
+	if (len + 1 > outlen)
+		return -ENOSPC;
+	out[len++] = '\n';
 	if (citer->data_size == INT_MAX)
 		citer->data_size = data_size;
+	return len;
+}
 
-	return 0;
+/*
+ * Refill the page with as many events as fit, in timestamp order. Only
+ * blocks for subbuffers while the page is still empty, so that the text
+ * formatted so far is handed out before waiting on a quiet cpu.
+ */
+static int ltt_relay_iter_fill(struct ltt_relay_iter *iter, int nonblock)
+{
+	struct ltt_relay_cpu_iter *citer;
+	int ret;
+
+	iter->len = 0;
+	iter->read_pos = 0;
+	memset(iter->types, 0, sizeof(iter->types));
+
+	for (;;) {
+		ret = ltt_relay_iter_get_subbufs(iter, !nonblock && !iter->len);
+		if (ret)
+			return iter->len ? 0 : ret;
+		if (!iter->heap_size)
+			return 0;	/* all buffers finalized and read */
+
+		citer = iter->heap[0];
+		ret = ltt_ascii_format_event(iter, citer,
+					     iter->page + iter->len,
+					     PAGE_SIZE - iter->len);
+		if (ret == -ENOSPC) {
+			if (iter->len)
+				return 0;
+			/* event larger than a page, truncated */
+			iter->page[PAGE_SIZE - 1] = '\n';
+			ret = PAGE_SIZE;
+		}
+		iter->len += ret;
+		ltt_relay_advance_cpu_iter(iter);
+	}
 }
 
-static struct seq_operations ascii_seq_ops = {
-	.start		= ascii_start,
-	.next		= ascii_next,
-	.stop		= ascii_stop,
-	.show		= ascii_show,
-};
+static ssize_t ltt_relay_ascii_read(struct file *file, char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct ltt_relay_iter *iter = file->private_data;
+	size_t copied = 0, n;
+	ssize_t ret = 0;
+
+	mutex_lock(&iter->lock);
+	while (copied < count) {
+		if (iter->read_pos == iter->len) {
+			ret = ltt_relay_iter_fill(iter,
+				copied || (file->f_flags & O_NONBLOCK));
+			if (ret || !iter->len)
+				break;
+		}
+		n = min(count - copied, iter->len - iter->read_pos);
+		if (copy_to_user(ubuf + copied, iter->page + iter->read_pos,
+				 n)) {
+			ret = -EFAULT;
+			break;
+		}
+		iter->read_pos += n;
+		copied += n;
+	}
+	mutex_unlock(&iter->lock);
+
+	if (copied) {
+		*ppos += copied;
+		return copied;
+	}
+	return ret;
+}
 
 /* FIXME : cpu hotplug support */
 static int ltt_relay_iter_open_channel(struct ltt_relay_iter *iter,
@@ -405,26 +518,9 @@ static int ltt_relay_iter_open_channel(struct ltt_relay_iter *iter,
 			citer->buf = NULL;
 			goto error;
 		}
-
-		for (;;) {
-			ret = subbuffer_start(citer,
-					      &citer->read_sb_offset);
-			DEBUGP(KERN_DEBUG
-				"LTT ASCII open start "
-				"cpu %d ret %d offset %lX\n",
-				citer->buf->a.cpu, ret, citer->read_sb_offset);
-			if (!ret || ret == -ENODATA) {
-				break;	/* got data, or finalized */
-			} else {	/* -EAGAIN */
-				if (signal_pending(current))
-					break;
-				schedule_timeout_interruptible(1);
-			}
-		}
-		update_cpu_iter(citer, citer->hdr_offset);
+		/* subbuffers are taken on the first read */
+		cpu_iter_wait_subbuffer(citer);
 	}
-	if (!iter->nr_refs)
-		return -ENODATA; /* no data available */
 	return 0;
 
 error:
@@ -471,19 +567,22 @@ static int ltt_relay_ascii_open(struct inode *inode, struct file *file)
 	if (!iter)
 		return -ENOMEM;
 
+	iter->page = (char *)__get_free_page(GFP_KERNEL);
+	if (!iter->page) {
+		ret = -ENOMEM;
+		goto error_free_alloc;
+	}
+	mutex_init(&iter->lock);
 	iter->chan = chan;
 	ret = ltt_relay_iter_open_channel(iter, chan);
 	if (ret)
-		goto error_free_alloc;
+		goto error_free_page;
 
-	ret = seq_open(file, &ascii_seq_ops);
-	if (ret)
-		goto error_release_channel;
-	((struct seq_file *)file->private_data)->private = iter;
-	return 0;
+	file->private_data = iter;
+	return nonseekable_open(inode, file);
 
-error_release_channel:
-	ltt_relay_iter_release_channel(iter);
+error_free_page:
+	free_page((unsigned long)iter->page);
 error_free_alloc:
 	kfree(iter);
 	return ret;
@@ -491,17 +590,17 @@ error_free_alloc:
 
 static int ltt_relay_ascii_release(struct inode *inode, struct file *file)
 {
-	struct seq_file *seq = file->private_data;
-	struct ltt_relay_iter *iter = seq->private;
+	struct ltt_relay_iter *iter = file->private_data;
 
 	ltt_relay_iter_release_channel(iter);
+	free_page((unsigned long)iter->page);
 	kfree(iter);
 	return 0;
 }
 
 static struct file_operations ltt_ascii_fops =
 {
-	.read = seq_read,
+	.read = ltt_relay_ascii_read,
 	.open = ltt_relay_ascii_open,
 	.release = ltt_relay_ascii_release,
 	.llseek = no_llseek,
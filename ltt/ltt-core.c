@@ -12,6 +12,7 @@
 #include <linux/debugfs.h>
 #include <linux/kref.h>
 #include <linux/cpu.h>
+#include <linux/rcupdate.h>
 
 /* Traces structures */
 struct ltt_traces ltt_traces = {
@@ -105,3 +106,37 @@ void ltt_filter_unregister(void)
 	ltt_run_filter = ltt_run_filter_default;
 }
 EXPORT_SYMBOL_GPL(ltt_filter_unregister);
+
+static void ltt_snapshot_default(int from_panic)
+{
+}
+
+static ltt_snapshot_functor ltt_snapshot_func = ltt_snapshot_default;
+
+/*
+ * Built in so that the panic and hung task paths can request a snapshot
+ * whether or not the tracer module is loaded.
+ */
+void ltt_snapshot_trigger(int from_panic)
+{
+	ltt_snapshot_functor func;
+
+	rcu_read_lock_sched_notrace();
+	func = rcu_dereference(ltt_snapshot_func);
+	func(from_panic);
+	rcu_read_unlock_sched_notrace();
+}
+EXPORT_SYMBOL_GPL(ltt_snapshot_trigger);
+
+void ltt_snapshot_register(ltt_snapshot_functor func)
+{
+	rcu_assign_pointer(ltt_snapshot_func, func);
+}
+EXPORT_SYMBOL_GPL(ltt_snapshot_register);
+
+void ltt_snapshot_unregister(void)
+{
+	rcu_assign_pointer(ltt_snapshot_func, ltt_snapshot_default);
+	synchronize_sched();
+}
+EXPORT_SYMBOL_GPL(ltt_snapshot_unregister);
@@ -2,15 +2,42 @@
  * Copyright (C) 2008 Mathieu Desnoyers
  *
  * Dual LGPL v2.1/GPL v2 license.
+ *
+ * Marker filters: an expression on the event fields is compiled to a small
+ * program attached to the active marker, which ltt_vtrace() runs before
+ * reserving space for the event. Filters are set by writing
+ *
+ *   <channel> <marker> <expression>
+ *
+ * to the marker file of the filter directory. An empty expression removes the
+ * filter. Expressions combine tests with &&, ||, ! and parentheses. A test
+ * compares a field with an integer (==, !=, <, <=, >, >=), or a string field
+ * with a quoted string (== or !=), a trailing '*' matching any suffix.
+ * Fields are the names given to the arguments in the marker format, argN for
+ * the Nth argument, and $pid, $tgid, $cpu and $comm for the context.
+ *
+ * i.e.: echo 'fs ioctl $pid == 42 && cmd != 0x5401' > marker
+ *       echo 'fs open !(filename == "/proc*" || $comm == "adbd")' > marker
+ *
+ * Events recorded by specialized probes (ltt_specialized_trace) are not
+ * filtered.
  */
 
 #include <linux/module.h>
 #include <linux/debugfs.h>
 #include <linux/fs.h>
+#include <linux/ctype.h>
+#include <linux/marker.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/ltt-tracer.h>
 #include <linux/mutex.h>
 
-#define LTT_FILTER_DIR	"filter"
+#define LTT_FILTER_DIR		"filter"
+#define LTT_FILTER_MARKER	"marker"
+#define LTT_FILTER_NAME_LEN	64
+/* Parentheses and ! nesting allowed in an expression */
+#define LTT_FILTER_MAX_NESTING	8
 
 /*
  * Protects the ltt_filter_dir allocation.
@@ -42,8 +69,423 @@ err_no_root:
 }
 EXPORT_SYMBOL_GPL(get_filter_root);
 
+static struct dentry *ltt_filter_marker_dentry;
+
+static const struct {
+	const char *name;
+	enum ltt_filter_field field;
+	enum ltt_type type;
+} ltt_filter_context[] = {
+	{ "$pid", LTT_FILTER_FIELD_PID, LTT_TYPE_SIGNED_INT },
+	{ "$tgid", LTT_FILTER_FIELD_TGID, LTT_TYPE_SIGNED_INT },
+	{ "$cpu", LTT_FILTER_FIELD_CPU, LTT_TYPE_SIGNED_INT },
+	{ "$comm", LTT_FILTER_FIELD_COMM, LTT_TYPE_STRING },
+};
+
+struct ltt_filter_parser {
+	const char *p;			/* next character */
+	const char *fmt;		/* marker format, NULL if unknown */
+	const struct ltt_serialize_ops *ops;
+	struct ltt_filter *filter;
+	unsigned int str_len;		/* bytes used in filter->strings */
+	int depth;			/* boolean stack depth */
+	int nesting;
+};
+
+/*
+ * Find field name in a marker format. Fields are numbered like the
+ * conversions, and named by the last word before them ("pid %d comm %s").
+ */
+static int ltt_filter_field_index(const char *fmt, const char *name,
+				  size_t len)
+{
+	const char *word = NULL, *tok;
+	size_t word_len = 0;
+	int idx = 0, conv;
+
+	for (;;) {
+		while (isspace(*fmt))
+			fmt++;
+		if (!*fmt)
+			break;
+		tok = fmt;
+		conv = 0;
+		while (*fmt && !isspace(*fmt)) {
+			if (*fmt == '%') {
+				if (fmt[1] == '%') {	/* Escaped %% */
+					fmt += 2;
+					continue;
+				}
+				if (word_len == len
+				    && !strncmp(word, name, len))
+					return idx;
+				idx++;
+				conv = 1;
+			}
+			fmt++;
+		}
+		if (!conv && *tok != '#') {
+			word = tok;
+			word_len = fmt - tok;
+		}
+	}
+	return -ENOENT;
+}
+
+static void parse_space(struct ltt_filter_parser *ps)
+{
+	while (isspace(*ps->p))
+		ps->p++;
+}
+
+static int emit(struct ltt_filter_parser *ps,
+		const struct ltt_filter_insn *insn)
+{
+	struct ltt_filter *filter = ps->filter;
+
+	if (filter->nr_insns == LTT_FILTER_MAX_INSNS)
+		return -E2BIG;
+	if (insn->op == LTT_FILTER_OP_TEST) {
+		/* the stack is a bitmask in ltt_filter_match() */
+		if (++ps->depth > BITS_PER_LONG)
+			return -E2BIG;
+	} else if (insn->op != LTT_FILTER_OP_NOT) {
+		ps->depth--;
+	}
+	filter->insn[filter->nr_insns++] = *insn;
+	return 0;
+}
+
+static int emit_op(struct ltt_filter_parser *ps, enum ltt_filter_opcode op)
+{
+	struct ltt_filter_insn insn;
+
+	memset(&insn, 0, sizeof(insn));
+	insn.op = op;
+	return emit(ps, &insn);
+}
+
+static int parse_field(struct ltt_filter_parser *ps,
+		       struct ltt_filter_insn *insn, enum ltt_type *type)
+{
+	const char *name = ps->p;
+	char *end;
+	size_t len;
+	int i, idx = -ENOENT;
+
+	if (*ps->p == '$')
+		ps->p++;
+	while (isalnum(*ps->p) || *ps->p == '_')
+		ps->p++;
+	len = ps->p - name;
+	if (!len)
+		return -EINVAL;
+
+	if (*name == '$') {
+		for (i = 0; i < ARRAY_SIZE(ltt_filter_context); i++) {
+			if (strlen(ltt_filter_context[i].name) != len
+			    || strncmp(ltt_filter_context[i].name, name, len))
+				continue;
+			insn->field = ltt_filter_context[i].field;
+			*type = ltt_filter_context[i].type;
+			return 0;
+		}
+		return -ENOENT;
+	}
+
+	if (ps->fmt)
+		idx = ltt_filter_field_index(ps->fmt, name, len);
+	if (idx < 0 && len > 3 && !strncmp(name, "arg", 3)) {
+		idx = simple_strtoul(name + 3, &end, 10);
+		if (end != ps->p)
+			return -ENOENT;
+	}
+	if (idx < 0)
+		return -ENOENT;
+	/* event fields are fetched following the compiled format */
+	if (!ps->ops->compiled || idx >= ps->ops->nr_ops)
+		return -EINVAL;
+
+	insn->field = LTT_FILTER_FIELD_ARG;
+	insn->arg = idx;
+	*type = ps->ops->op[idx].trace_type;
+	ps->filter->nr_args = max_t(unsigned int, ps->filter->nr_args,
+				    idx + 1);
+	return 0;
+}
+
+static int parse_test(struct ltt_filter_parser *ps)
+{
+	struct ltt_filter *filter = ps->filter;
+	struct ltt_filter_insn insn;
+	enum ltt_type type;
+	const char *str;
+	char *end;
+	size_t len;
+	int negate = 0, ret;
+
+	memset(&insn, 0, sizeof(insn));
+	insn.op = LTT_FILTER_OP_TEST;
+	ret = parse_field(ps, &insn, &type);
+	if (ret)
+		return ret;
+	insn.is_signed = type == LTT_TYPE_SIGNED_INT;
+
+	parse_space(ps);
+	if (!strncmp(ps->p, "==", 2)) {
+		insn.cmp = LTT_FILTER_CMP_EQ;
+		ps->p += 2;
+	} else if (!strncmp(ps->p, "!=", 2)) {
+		insn.cmp = LTT_FILTER_CMP_NE;
+		ps->p += 2;
+	} else if (!strncmp(ps->p, "<=", 2)) {
+		insn.cmp = LTT_FILTER_CMP_LE;
+		ps->p += 2;
+	} else if (!strncmp(ps->p, ">=", 2)) {
+		insn.cmp = LTT_FILTER_CMP_GE;
+		ps->p += 2;
+	} else if (*ps->p == '<') {
+		insn.cmp = LTT_FILTER_CMP_LT;
+		ps->p++;
+	} else if (*ps->p == '>') {
+		insn.cmp = LTT_FILTER_CMP_GT;
+		ps->p++;
+	} else {
+		return -EINVAL;
+	}
+	parse_space(ps);
+
+	if (type == LTT_TYPE_STRING) {
+		if (insn.cmp != LTT_FILTER_CMP_EQ
+		    && insn.cmp != LTT_FILTER_CMP_NE)
+			return -EINVAL;
+		if (*ps->p != '"')
+			return -EINVAL;
+		str = ++ps->p;
+		end = strchr(str, '"');
+		if (!end)
+			return -EINVAL;
+		len = end - str;
+		ps->p = end + 1;
+
+		negate = insn.cmp == LTT_FILTER_CMP_NE;
+		insn.cmp = LTT_FILTER_CMP_STREQ;
+		if (len && str[len - 1] == '*') {
+			insn.cmp = LTT_FILTER_CMP_PREFIX;
+			len--;
+		}
+		if (ps->str_len + len > LTT_FILTER_MAX_STRINGS)
+			return -E2BIG;
+		memcpy(&filter->strings[ps->str_len], str, len);
+		insn.str = ps->str_len;
+		insn.str_len = len;
+		ps->str_len += len;
+	} else {
+		insn.imm = simple_strtoll(ps->p, &end, 0);
+		if (end == ps->p)
+			return -EINVAL;
+		ps->p = end;
+	}
+
+	ret = emit(ps, &insn);
+	if (!ret && negate)
+		ret = emit_op(ps, LTT_FILTER_OP_NOT);
+	return ret;
+}
+
+static int parse_or(struct ltt_filter_parser *ps);
+
+static int parse_unary(struct ltt_filter_parser *ps)
+{
+	int ret;
+
+	parse_space(ps);
+	if (*ps->p != '!' && *ps->p != '(')
+		return parse_test(ps);
+
+	if (++ps->nesting > LTT_FILTER_MAX_NESTING)
+		return -E2BIG;
+	if (*ps->p == '!') {
+		ps->p++;
+		ret = parse_unary(ps);
+		if (!ret)
+			ret = emit_op(ps, LTT_FILTER_OP_NOT);
+	} else {
+		ps->p++;
+		ret = parse_or(ps);
+		parse_space(ps);
+		if (!ret && *ps->p++ != ')')
+			ret = -EINVAL;
+	}
+	ps->nesting--;
+	return ret;
+}
+
+static int parse_and(struct ltt_filter_parser *ps)
+{
+	int ret;
+
+	ret = parse_unary(ps);
+	while (!ret) {
+		parse_space(ps);
+		if (strncmp(ps->p, "&&", 2))
+			break;
+		ps->p += 2;
+		ret = parse_unary(ps);
+		if (!ret)
+			ret = emit_op(ps, LTT_FILTER_OP_AND);
+	}
+	return ret;
+}
+
+static int parse_or(struct ltt_filter_parser *ps)
+{
+	int ret;
+
+	ret = parse_and(ps);
+	while (!ret) {
+		parse_space(ps);
+		if (strncmp(ps->p, "||", 2))
+			break;
+		ps->p += 2;
+		ret = parse_and(ps);
+		if (!ret)
+			ret = emit_op(ps, LTT_FILTER_OP_OR);
+	}
+	return ret;
+}
+
+static int ltt_filter_compile(struct ltt_filter *filter, const char *expr,
+			      const char *fmt,
+			      const struct ltt_serialize_ops *ops)
+{
+	struct ltt_filter_parser ps = {
+		.p = expr,
+		.fmt = fmt,
+		.ops = ops,
+		.filter = filter,
+	};
+	int ret;
+
+	ret = parse_or(&ps);
+	if (ret)
+		return ret;
+	parse_space(&ps);
+	return *ps.p ? -EINVAL : 0;
+}
+
+/**
+ * ltt_filter_set - Set the filter of a connected marker
+ * @channel: marker channel
+ * @name: marker name
+ * @expr: filter expression, NULL or empty to remove the filter
+ *
+ * Only markers connected to the default probe can be filtered. Fields of the
+ * event can only be used if the marker was loaded when it was connected.
+ */
+int ltt_filter_set(const char *channel, const char *name, const char *expr)
+{
+	struct ltt_active_marker *pdata;
+	struct ltt_filter *filter = NULL, *old = NULL;
+	int ret = 0;
+
+	while (expr && isspace(*expr))
+		expr++;
+
+	lock_markers();
+	pdata = marker_get_private_data(channel, name, ltt_vtrace, 0);
+	if (IS_ERR(pdata) || !pdata) {
+		ret = -ENOENT;
+		goto end;
+	}
+	if (expr && *expr) {
+		filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+		if (!filter) {
+			ret = -ENOMEM;
+			goto end;
+		}
+		ret = ltt_filter_compile(filter, expr,
+					 marker_get_fmt(channel, name),
+					 &pdata->ops);
+		if (ret) {
+			kfree(filter);
+			goto end;
+		}
+	}
+	old = pdata->filter;
+	rcu_assign_pointer(pdata->filter, filter);
+end:
+	unlock_markers();
+	if (old) {
+		/* ltt_vtrace() runs in rcu_sched read-side critical sections */
+		synchronize_sched();
+		kfree(old);
+	}
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ltt_filter_set);
+
+static ssize_t marker_op_write(struct file *file,
+	const char __user *user_buf, size_t count, loff_t *ppos)
+{
+	char channel[LTT_FILTER_NAME_LEN], name[LTT_FILTER_NAME_LEN];
+	int err, buf_size, expr = 0;
+	char *end;
+	char *buf = (char *)__get_free_page(GFP_KERNEL);
+
+	if (!buf)
+		return -ENOMEM;
+	buf_size = min_t(size_t, count, PAGE_SIZE - 1);
+	err = copy_from_user(buf, user_buf, buf_size);
+	if (err) {
+		err = -EFAULT;
+		goto end;
+	}
+	buf[buf_size] = '\0';
+	end = strchr(buf, '\n');
+	if (end)
+		*end = '\0';
+
+	if (sscanf(buf, "%63s %63s %n", channel, name, &expr) < 2) {
+		err = -EINVAL;
+		goto end;
+	}
+	err = ltt_filter_set(channel, name, buf + expr);
+	if (!err)
+		err = count;
+end:
+	free_page((unsigned long)buf);
+	return err;
+}
+
+static const struct file_operations ltt_filter_marker_operations = {
+	.write = marker_op_write,
+};
+
+static int __init ltt_filter_init(void)
+{
+	struct dentry *filter_root = get_filter_root();
+
+	if (!filter_root)
+		return -ENOENT;
+
+	ltt_filter_marker_dentry = debugfs_create_file(LTT_FILTER_MARKER,
+					S_IWUSR, filter_root, NULL,
+					&ltt_filter_marker_operations);
+	if (IS_ERR(ltt_filter_marker_dentry) || !ltt_filter_marker_dentry) {
+		printk(KERN_ERR
+		       "ltt_filter_init: failed to create file %s\n",
+		       LTT_FILTER_MARKER);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+module_init(ltt_filter_init);
+
 static void __exit ltt_filter_exit(void)
 {
+	debugfs_remove(ltt_filter_marker_dentry);
 	debugfs_remove(ltt_filter_dir);
 }
 
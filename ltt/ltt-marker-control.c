@@ -42,6 +42,15 @@ static LIST_HEAD(markers_loaded_list);
  */
 static LIST_HEAD(probes_registered_list);
 
+/*
+ * Also frees the filter attached by ltt-filter, if any.
+ */
+static void free_active_marker(struct ltt_active_marker *pdata)
+{
+	kfree(pdata->filter);
+	kmem_cache_free(markers_loaded_cachep, pdata);
+}
+
 static struct ltt_available_probe *get_probe_from_name(const char *pname)
 {
 	struct ltt_available_probe *iter;
@@ -104,7 +113,7 @@ int ltt_probe_unregister(struct ltt_available_probe *pdata)
 			if (ret)
 				goto end;
 			list_del(&amark->node);
-			kmem_cache_free(markers_loaded_cachep, amark);
+			free_active_marker(amark);
 		}
 	}
 	list_del(&pdata->node);
@@ -125,6 +134,7 @@ int ltt_marker_connect(const char *channel, const char *mname,
 	int ret;
 	struct ltt_active_marker *pdata;
 	struct ltt_available_probe *probe;
+	const char *fmt;
 
 	ltt_lock_traces();
 	mutex_lock(&probes_mutex);
@@ -144,13 +154,25 @@ int ltt_marker_connect(const char *channel, const char *mname,
 		goto end;
 	}
 	pdata->probe = probe;
+	/*
+	 * Precompile the format for the default serializer. It is not known
+	 * yet if the marker is not loaded, in which case the event is
+	 * serialized from the format string.
+	 */
+	if (probe->callbacks[0] == ltt_serialize_data) {
+		lock_markers();
+		fmt = marker_get_fmt(channel, mname);
+		if (fmt)
+			ltt_serialize_compile(&pdata->ops, fmt);
+		unlock_markers();
+	}
 	/*
 	 * ID has priority over channel in case of conflict.
 	 */
 	ret = marker_probe_register(channel, mname, NULL,
 		probe->probe_func, pdata);
 	if (ret)
-		kmem_cache_free(markers_loaded_cachep, pdata);
+		free_active_marker(pdata);
 	else
 		list_add(&pdata->node, &markers_loaded_list);
 end:
@@ -192,7 +214,7 @@ int ltt_marker_disconnect(const char *channel, const char *mname,
 		goto end;
 	else {
 		list_del(&pdata->node);
-		kmem_cache_free(markers_loaded_cachep, pdata);
+		free_active_marker(pdata);
 	}
 end:
 	mutex_unlock(&probes_mutex);
@@ -208,7 +230,7 @@ static void disconnect_all_markers(void)
 		marker_probe_unregister_private_data(pdata->probe->probe_func,
 			pdata);
 		list_del(&pdata->node);
-		kmem_cache_free(markers_loaded_cachep, pdata);
+		free_active_marker(pdata);
 	}
 }
 
@@ -774,6 +774,35 @@ static void ltt_relay_finish_channel(struct ltt_chan *chan)
 		ltt_relay_finish_buffer(chan, i);
 }
 
+/*
+ * Switch out the current subbuffers for a snapshot. Does not wake anybody up,
+ * as it can be called from the panic path. Must be called when no tracing is
+ * active in the channel.
+ */
+static void ltt_relay_snapshot_channel(struct ltt_chan *chan)
+{
+	unsigned int i;
+
+	for_each_possible_cpu(i) {
+		struct ltt_chanbuf *buf = per_cpu_ptr(chan->a.buf, i);
+
+		if (buf->a.allocated)
+			ltt_relay_buffer_flush(buf);
+	}
+}
+
+static void ltt_relay_resume_channel(struct ltt_chan *chan)
+{
+	unsigned int i;
+
+	for_each_possible_cpu(i) {
+		struct ltt_chanbuf *buf = per_cpu_ptr(chan->a.buf, i);
+
+		if (buf->a.allocated)
+			buf->finalized = 0;
+	}
+}
+
 /*
  * This is called with preemption disabled when user space has requested
  * blocking mode.  If one of the active traces has free space below a
@@ -1315,6 +1344,8 @@ static struct ltt_transport ltt_relay_transport = {
 		.remove_dirs = ltt_relay_remove_dirs,
 		.create_channel = ltt_chan_create,
 		.finish_channel = ltt_relay_finish_channel,
+		.snapshot_channel = ltt_relay_snapshot_channel,
+		.resume_channel = ltt_relay_resume_channel,
 		.remove_channel = ltt_chan_free,
 		.wakeup_channel = ltt_relay_async_wakeup_chan,
 		.user_blocking = ltt_relay_user_blocking,
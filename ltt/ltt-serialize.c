@@ -13,19 +13,14 @@
 
 #include <stdarg.h>
 #include <linux/ctype.h>
+#include <linux/log2.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/sched.h>
 #include <linux/ltt-tracer.h>
 
 #include "ltt-relay-select.h"
 
-enum ltt_type {
-	LTT_TYPE_SIGNED_INT,
-	LTT_TYPE_UNSIGNED_INT,
-	LTT_TYPE_STRING,
-	LTT_TYPE_NONE,
-};
-
 #define LTT_ATTRIBUTE_NETWORK_BYTE_ORDER (1<<1)
 
 /*
@@ -547,6 +542,169 @@ ltt_serialize_data(struct ltt_chanbuf *buf, size_t buf_offset,
 }
 EXPORT_SYMBOL_GPL(ltt_serialize_data);
 
+/*
+ * Compile a format string into a list of field operations, following the same
+ * rules as ltt_serialize_data(), so that ltt_vtrace() does not have to parse
+ * the format twice for each event. Field offsets and alignment are computed
+ * here: the payload starts on largest_align, which makes them constant for
+ * formats without strings. Returns -EINVAL for formats the op list cannot
+ * express; those keep going through the probe callbacks.
+ */
+int ltt_serialize_compile(struct ltt_serialize_ops *ops, const char *fmt)
+{
+	char trace_size = 0, c_size = 0;
+	enum ltt_type trace_type = LTT_TYPE_NONE, c_type;
+	unsigned long attributes = 0;
+	struct ltt_serialize_op *op;
+	size_t offset = 0;
+	int largest_align = 1;
+	int fixed = 1;
+
+	memset(ops, 0, sizeof(*ops));
+	for (; *fmt ; ++fmt) {
+		switch (*fmt) {
+		case '#':
+			/* tracetypes (#) */
+			++fmt;			/* skip first '#' */
+			if (*fmt == '#')	/* Escaped ## */
+				break;
+			attributes = 0;
+			fmt = parse_trace_type(fmt, &trace_size, &trace_type,
+					       &attributes);
+			break;
+		case '%':
+			/* c types (%) */
+			++fmt;			/* skip first '%' */
+			if (*fmt == '%')	/* Escaped %% */
+				break;
+			c_type = LTT_TYPE_NONE;
+			fmt = parse_c_type(fmt, &c_size, &c_type, NULL);
+			if (c_type == LTT_TYPE_NONE)
+				return -EINVAL;
+			if (!trace_size)
+				trace_size = c_size;
+			if (trace_type == LTT_TYPE_NONE)
+				trace_type = c_type;
+			if (c_type == LTT_TYPE_STRING)
+				trace_type = LTT_TYPE_STRING;
+			if (ops->nr_ops == LTT_SERIALIZE_MAX_OPS)
+				return -EINVAL;
+			op = &ops->op[ops->nr_ops++];
+			op->trace_type = trace_type;
+			op->trace_size = trace_size;
+			op->c_size = c_size;
+			if (trace_type == LTT_TYPE_STRING) {
+				fixed = 0;
+			} else {
+				if (!is_power_of_2(trace_size) || trace_size > 8
+				    || !is_power_of_2(c_size) || c_size > 8)
+					return -EINVAL;
+				if (ltt_get_alignment()) {
+					offset += ltt_align(offset, trace_size);
+					largest_align = max_t(int, largest_align,
+							      trace_size);
+				}
+				if (offset + trace_size > LTT_SERIALIZE_FIXED_MAX)
+					fixed = 0;
+				else
+					op->offset = offset;
+				offset += trace_size;
+			}
+			trace_size = 0;
+			c_size = 0;
+			trace_type = LTT_TYPE_NONE;
+			attributes = 0;
+			break;
+			/* default is to skip the text, doing nothing */
+		}
+	}
+	ops->fixed = fixed;
+	if (fixed)
+		ops->data_size = offset;
+	ops->largest_align = min_t(int, largest_align, sizeof(void *));
+	ops->compiled = 1;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ltt_serialize_compile);
+
+/*
+ * Walk a compiled format. Computes the payload size when buf is NULL, like
+ * ltt_serialize_data(). The c type is not needed to write a field.
+ */
+static notrace
+size_t ltt_serialize_ops_data(struct ltt_chanbuf *buf, size_t buf_offset,
+			      const struct ltt_serialize_ops *ops,
+			      va_list *args)
+{
+	const struct ltt_serialize_op *op;
+
+	for (op = ops->op; op < ops->op + ops->nr_ops; op++)
+		buf_offset = serialize_trace_data(buf, buf_offset,
+						  op->trace_size,
+						  op->trace_type, op->c_size,
+						  LTT_TYPE_NONE, NULL, args);
+	return buf_offset;
+}
+
+/*
+ * Serialize a fixed format into a flat payload, which is then copied as is in
+ * each trace. Conversions are the ones done by serialize_trace_data(). The
+ * alignment padding between fields is zeroed: it must not leak stack data.
+ */
+static notrace
+void ltt_serialize_fixed(char *data, const struct ltt_serialize_ops *ops,
+			 va_list *args)
+{
+	const struct ltt_serialize_op *op;
+	unsigned long v_ulong;
+	uint64_t v;
+
+	memset(data, 0, ops->data_size);
+	for (op = ops->op; op < ops->op + ops->nr_ops; op++) {
+		if (op->c_size == 8) {
+			v = va_arg(*args, uint64_t);
+		} else {
+			if (op->trace_type == LTT_TYPE_SIGNED_INT) {
+				int i = va_arg(*args, int);
+
+				if (op->c_size == 1)
+					v_ulong = (long)(int8_t)i;
+				else if (op->c_size == 2)
+					v_ulong = (long)(int16_t)i;
+				else
+					v_ulong = (long)(int32_t)i;
+			} else {
+				unsigned int u = va_arg(*args, unsigned int);
+
+				if (op->c_size == 1)
+					v_ulong = (uint8_t)u;
+				else if (op->c_size == 2)
+					v_ulong = (uint16_t)u;
+				else
+					v_ulong = (uint32_t)u;
+			}
+			v = v_ulong;
+		}
+
+		switch (op->trace_size) {
+		case 1:
+			data[op->offset] = (uint8_t)v;
+			break;
+		case 2:
+			memcpy(&data[op->offset], (uint16_t[]){ (uint16_t)v },
+			       sizeof(uint16_t));
+			break;
+		case 4:
+			memcpy(&data[op->offset], (uint32_t[]){ (uint32_t)v },
+			       sizeof(uint32_t));
+			break;
+		case 8:
+			memcpy(&data[op->offset], &v, sizeof(uint64_t));
+			break;
+		}
+	}
+}
+
 static inline
 uint64_t unserialize_base_type(struct ltt_chanbuf *buf,
 			       size_t *ppos, char trace_size,
@@ -770,6 +928,158 @@ EXPORT_SYMBOL_GPL(ltt_fmt_largest_align);
 
 #endif
 
+/*
+ * Fetch the first fields of an event for its filter: integers extended to 64
+ * bits following their type, strings as pointers.
+ */
+static notrace
+void ltt_filter_fetch_args(const struct ltt_serialize_ops *ops,
+			   unsigned int nr, unsigned long long *vals,
+			   va_list *args)
+{
+	const struct ltt_serialize_op *op;
+	const char *s;
+
+	for (op = ops->op; op < ops->op + nr; op++, vals++) {
+		if (op->trace_type == LTT_TYPE_STRING) {
+			s = va_arg(*args, const char *);
+			if ((unsigned long)s < PAGE_SIZE)
+				s = "<NULL>";
+			*vals = (unsigned long)s;
+		} else if (op->c_size == 8) {
+			*vals = va_arg(*args, unsigned long long);
+		} else if (op->trace_type == LTT_TYPE_SIGNED_INT) {
+			int i = va_arg(*args, int);
+
+			if (op->c_size == 1)
+				*vals = (long long)(int8_t)i;
+			else if (op->c_size == 2)
+				*vals = (long long)(int16_t)i;
+			else
+				*vals = (long long)i;
+		} else {
+			unsigned int u = va_arg(*args, unsigned int);
+
+			if (op->c_size == 1)
+				*vals = (uint8_t)u;
+			else if (op->c_size == 2)
+				*vals = (uint16_t)u;
+			else
+				*vals = u;
+		}
+	}
+}
+
+static notrace
+int ltt_filter_test(const struct ltt_filter *filter,
+		    const struct ltt_filter_insn *insn,
+		    const unsigned long long *vals, int cpu)
+{
+	unsigned long long v;
+	const char *s;
+
+	switch (insn->field) {
+	case LTT_FILTER_FIELD_PID:
+		v = current->pid;
+		break;
+	case LTT_FILTER_FIELD_TGID:
+		v = current->tgid;
+		break;
+	case LTT_FILTER_FIELD_CPU:
+		v = cpu;
+		break;
+	case LTT_FILTER_FIELD_COMM:
+		s = current->comm;
+		goto string;
+	default:
+		if (insn->cmp >= LTT_FILTER_CMP_STREQ) {
+			s = (const char *)(unsigned long)vals[insn->arg];
+			goto string;
+		}
+		v = vals[insn->arg];
+	}
+
+	if (insn->is_signed) {
+		switch (insn->cmp) {
+		case LTT_FILTER_CMP_EQ:
+			return (long long)v == insn->imm;
+		case LTT_FILTER_CMP_NE:
+			return (long long)v != insn->imm;
+		case LTT_FILTER_CMP_LT:
+			return (long long)v < insn->imm;
+		case LTT_FILTER_CMP_LE:
+			return (long long)v <= insn->imm;
+		case LTT_FILTER_CMP_GT:
+			return (long long)v > insn->imm;
+		default:
+			return (long long)v >= insn->imm;
+		}
+	} else {
+		switch (insn->cmp) {
+		case LTT_FILTER_CMP_EQ:
+			return v == (unsigned long long)insn->imm;
+		case LTT_FILTER_CMP_NE:
+			return v != (unsigned long long)insn->imm;
+		case LTT_FILTER_CMP_LT:
+			return v < (unsigned long long)insn->imm;
+		case LTT_FILTER_CMP_LE:
+			return v <= (unsigned long long)insn->imm;
+		case LTT_FILTER_CMP_GT:
+			return v > (unsigned long long)insn->imm;
+		default:
+			return v >= (unsigned long long)insn->imm;
+		}
+	}
+
+string:
+	if (strncmp(s, &filter->strings[insn->str], insn->str_len))
+		return 0;
+	return insn->cmp == LTT_FILTER_CMP_PREFIX || s[insn->str_len] == '\0';
+}
+
+/*
+ * Run a marker filter on an event. The result of each test is pushed on a
+ * bitmask, the compiler makes sure the stack fits in it.
+ */
+static notrace
+int ltt_filter_match(const struct ltt_filter *filter,
+		     const struct ltt_serialize_ops *ops, int cpu,
+		     va_list *args)
+{
+	unsigned long long vals[LTT_SERIALIZE_MAX_OPS];
+	const struct ltt_filter_insn *insn;
+	unsigned long stack = 0;
+	va_list args_copy;
+
+	if (filter->nr_args) {
+		va_copy(args_copy, *args);
+		ltt_filter_fetch_args(ops, filter->nr_args, vals, &args_copy);
+		va_end(args_copy);
+	}
+
+	for (insn = filter->insn; insn < filter->insn + filter->nr_insns;
+	     insn++) {
+		switch (insn->op) {
+		case LTT_FILTER_OP_TEST:
+			stack = (stack << 1)
+				| ltt_filter_test(filter, insn, vals, cpu);
+			break;
+		case LTT_FILTER_OP_NOT:
+			stack ^= 1;
+			break;
+		case LTT_FILTER_OP_AND:
+			stack = ((stack >> 2) << 1)
+				| (stack & (stack >> 1) & 1);
+			break;
+		case LTT_FILTER_OP_OR:
+			stack = ((stack >> 2) << 1)
+				| ((stack | (stack >> 1)) & 1);
+			break;
+		}
+	}
+	return stack & 1;
+}
+
 /*
  * Calculate data size
  * Assume that the padding for alignment starts at a sizeof(void *) address.
@@ -815,9 +1125,12 @@ void ltt_vtrace(const struct marker *mdata, void *probe_data, void *call_data,
 	va_list args_copy;
 	struct ltt_serialize_closure closure;
 	struct ltt_probe_private_data *private_data = call_data;
+	const struct ltt_filter *filter;
 	void *serialize_private = NULL;
 	int cpu;
 	unsigned int rflags;
+	const struct ltt_serialize_ops *ops = NULL;
+	char fixed_data[LTT_SERIALIZE_FIXED_MAX];
 
 	/*
 	 * This test is useful for quickly exiting static tracing when no trace
@@ -841,23 +1154,50 @@ void ltt_vtrace(const struct marker *mdata, void *probe_data, void *call_data,
 	eID = mdata->event_id;
 	chan_index = mdata->channel_id;
 	closure.callbacks = pdata->probe->callbacks;
+	if (likely(pdata->ops.compiled))
+		ops = &pdata->ops;
 
 	if (unlikely(private_data)) {
 		dest_trace = private_data->trace;
-		if (private_data->serializer)
+		if (private_data->serializer) {
 			closure.callbacks = &private_data->serializer;
+			ops = NULL;
+		}
 		serialize_private = private_data->serialize_private;
 	}
 
-	va_copy(args_copy, *args);
-	/*
-	 * Assumes event payload to start on largest_align alignment.
-	 */
-	largest_align = 1;	/* must be non-zero for ltt_align */
-	data_size = ltt_get_data_size(&closure, serialize_private,
-				      &largest_align, fmt, &args_copy);
-	largest_align = min_t(int, largest_align, sizeof(void *));
-	va_end(args_copy);
+	/* Drop filtered out events before doing any serialization work */
+	filter = rcu_dereference(pdata->filter);
+	if (unlikely(filter)
+	    && !ltt_filter_match(filter, &pdata->ops, cpu, args))
+		goto end;
+
+	if (likely(ops && ops->fixed)) {
+		/*
+		 * Fixed size payload: fetch the arguments once, each trace
+		 * gets a copy of the result.
+		 */
+		data_size = ops->data_size;
+		largest_align = ops->largest_align;
+		va_copy(args_copy, *args);
+		ltt_serialize_fixed(fixed_data, ops, &args_copy);
+		va_end(args_copy);
+	} else if (ops) {
+		va_copy(args_copy, *args);
+		data_size = ltt_serialize_ops_data(NULL, 0, ops, &args_copy);
+		largest_align = ops->largest_align;
+		va_end(args_copy);
+	} else {
+		va_copy(args_copy, *args);
+		/*
+		 * Assumes event payload to start on largest_align alignment.
+		 */
+		largest_align = 1;	/* must be non-zero for ltt_align */
+		data_size = ltt_get_data_size(&closure, serialize_private,
+					      &largest_align, fmt, &args_copy);
+		largest_align = min_t(int, largest_align, sizeof(void *));
+		va_end(args_copy);
+	}
 
 	/* Iterate on each trace */
 	list_for_each_entry_rcu(trace, &ltt_traces.head, list) {
@@ -895,18 +1235,33 @@ void ltt_vtrace(const struct marker *mdata, void *probe_data, void *call_data,
 		if (unlikely(ret < 0))
 			continue; /* buffer full */
 
-		va_copy(args_copy, *args);
 		/* Out-of-order write : header and data */
 		buf_offset = ltt_write_event_header(&buf->a, &chan->a,
 						    buf_offset, eID, data_size,
 						    tsc, rflags);
-		ltt_write_event_data(buf, buf_offset, &closure,
-				     serialize_private, largest_align, fmt,
-				     &args_copy);
-		va_end(args_copy);
+		if (likely(ops && ops->fixed)) {
+			if (data_size)
+				ltt_relay_write(&buf->a, buf->a.chan,
+					buf_offset + ltt_align(buf_offset,
+							       largest_align),
+					fixed_data, data_size);
+		} else {
+			va_copy(args_copy, *args);
+			if (ops)
+				ltt_serialize_ops_data(buf, buf_offset
+					+ ltt_align(buf_offset, largest_align),
+					ops, &args_copy);
+			else
+				ltt_write_event_data(buf, buf_offset, &closure,
+						     serialize_private,
+						     largest_align, fmt,
+						     &args_copy);
+			va_end(args_copy);
+		}
 		/* Out-of-order commit */
 		ltt_commit_slot(buf, chan, buf_offset, data_size, slot_size);
 	}
+end:
 	/*
 	 * asm volatile and "memory" clobber prevent the compiler from moving
 	 * instructions out of the ltt nesting count. This is required to ensure
@@ -199,6 +199,83 @@ static const struct file_operations ltt_enabled_operations = {
 	.write = enabled_write,
 };
 
+/*
+ * Write 1 to freeze the trace buffers and make them readable until drained,
+ * 0 to resume tracing into them.
+ */
+static ssize_t snapshot_write(struct file *file, const char __user *user_buf,
+			      size_t count, loff_t *ppos)
+{
+	int err = 0;
+	int buf_size;
+	char *buf = (char *)__get_free_page(GFP_KERNEL);
+	char *cmd = (char *)__get_free_page(GFP_KERNEL);
+
+	buf_size = min_t(size_t, count, PAGE_SIZE - 1);
+	err = copy_from_user(buf, user_buf, buf_size);
+	if (err)
+		goto err_copy_from_user;
+	buf[buf_size] = 0;
+
+	if (sscanf(buf, "%s", cmd) != 1) {
+		err = -EPERM;
+		goto err_get_cmd;
+	}
+
+	if (cmd[1]) {
+		err = -EPERM;
+		goto err_bad_cmd;
+	}
+
+	switch (cmd[0]) {
+	case 'Y':
+	case 'y':
+	case '1':
+		err = ltt_trace_snapshot(file->f_dentry->d_parent->d_name.name);
+		if (IS_ERR_VALUE(err)) {
+			printk(KERN_ERR
+			       "snapshot_write: ltt_trace_snapshot failed: %d\n",
+			       err);
+			err = -EPERM;
+			goto err_snapshot;
+		}
+		break;
+	case 'N':
+	case 'n':
+	case '0':
+		err = ltt_trace_snapshot_resume(
+				file->f_dentry->d_parent->d_name.name);
+		if (IS_ERR_VALUE(err)) {
+			printk(KERN_ERR
+			       "snapshot_write: ltt_trace_snapshot_resume "
+			       "failed: %d\n", err);
+			err = -EPERM;
+			goto err_resume;
+		}
+		break;
+	default:
+		err = -EPERM;
+		goto err_bad_cmd;
+	}
+
+	free_page((unsigned long)buf);
+	free_page((unsigned long)cmd);
+	return count;
+
+err_resume:
+err_snapshot:
+err_bad_cmd:
+err_get_cmd:
+err_copy_from_user:
+	free_page((unsigned long)buf);
+	free_page((unsigned long)cmd);
+	return err;
+}
+
+static const struct file_operations ltt_snapshot_operations = {
+	.write = snapshot_write,
+};
+
 
 static ssize_t trans_write(struct file *file, const char __user *user_buf,
 			   size_t count, loff_t *ppos)
@@ -592,6 +669,16 @@ static int _create_trace_control_dir(const char *trace_name,
 		goto err_create_subdir;
 	}
 
+	/* debugfs/control/trace_name/snapshot */
+	tmp_den = debugfs_create_file("snapshot", S_IWUSR, trace_root, NULL,
+				      &ltt_snapshot_operations);
+	if (IS_ERR(tmp_den) || !tmp_den) {
+		printk(KERN_ERR "_create_trace_control_dir: "
+		       "create file of snapshot failed\n");
+		err = -ENOMEM;
+		goto err_create_subdir;
+	}
+
 	/* debugfs/control/trace_name/channel/ */
 	channel_root = debugfs_create_dir("channel", trace_root);
 	if (IS_ERR(channel_root) || !channel_root) {
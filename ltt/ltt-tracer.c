@@ -39,6 +39,7 @@
 #include <linux/kref.h>
 #include <linux/delay.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
 static void async_wakeup(unsigned long data);
@@ -1103,6 +1104,43 @@ void ltt_channels_trace_stop_timer(struct ltt_chan *channels,
 	}
 }
 
+static void ltt_read_trace_clock(void *info)
+{
+	*(u64 *)info = trace_clock_read64();
+}
+
+/*
+ * Check that the trace clock read on each online CPU falls between two reads
+ * done on this CPU around the IPI. The offset found this way is a lower bound
+ * of the real one: events of different CPUs may be misordered by that much.
+ */
+static void ltt_trace_clock_check_sync(struct ltt_trace *trace)
+{
+	u64 before, remote, after, offset;
+	int cpu, this_cpu;
+
+	get_online_cpus();
+	this_cpu = get_cpu();
+	for_each_online_cpu(cpu) {
+		if (cpu == this_cpu)
+			continue;
+		before = trace_clock_read64();
+		smp_call_function_single(cpu, ltt_read_trace_clock, &remote, 1);
+		after = trace_clock_read64();
+		if (remote < before)
+			offset = before - remote;
+		else if (remote > after)
+			offset = remote - after;
+		else
+			continue;
+		printk(KERN_WARNING "LTT : Trace clock of CPU %d is off by at "
+		       "least %llu cycles for trace %s\n", cpu,
+		       (unsigned long long)offset, trace->trace_name);
+	}
+	put_cpu();
+	put_online_cpus();
+}
+
 /* must be called from within a traces lock. */
 static int _ltt_trace_start(struct ltt_trace *trace)
 {
@@ -1115,11 +1153,16 @@ static int _ltt_trace_start(struct ltt_trace *trace)
 	if (trace->active)
 		printk(KERN_INFO "LTT : Tracing already active for trace %s\n",
 				trace->trace_name);
+	if (trace->frozen) {
+		err = -EBUSY;
+		goto traces_error;
+	}
 	if (!try_module_get(ltt_run_filter_owner)) {
 		err = -ENODEV;
 		printk(KERN_ERR "LTT : Can't lock filter module.\n");
 		goto get_ltt_run_filter_error;
 	}
+	ltt_trace_clock_check_sync(trace);
 	ltt_channels_trace_start_timer(trace->channels, trace->nr_channels);
 	trace->active = 1;
 	/* Read by trace points without protection : be careful */
@@ -1175,6 +1218,20 @@ no_trace:
 EXPORT_SYMBOL_GPL(ltt_trace_start);
 
 /* must be called from within traces lock */
+/* Give frozen buffers back to the writers */
+static void ltt_trace_resume_channels(struct ltt_trace *trace)
+{
+	int i;
+
+	for (i = 0; i < trace->nr_channels; i++) {
+		struct ltt_chan *chan = &trace->channels[i];
+
+		if (chan->active)
+			trace->ops->resume_channel(chan);
+	}
+	trace->frozen = 0;
+}
+
 static int _ltt_trace_stop(struct ltt_trace *trace)
 {
 	int err = -EPERM;
@@ -1193,6 +1250,9 @@ static int _ltt_trace_stop(struct ltt_trace *trace)
 		ltt_traces.num_active_traces--;
 		synchronize_sched(); /* Wait for each tracing to be finished */
 	}
+	/* A stopped trace can be started again: it must not stay finalized */
+	if (trace->frozen)
+		ltt_trace_resume_channels(trace);
 	module_put(ltt_run_filter_owner);
 	/* Everything went fine */
 	return 0;
@@ -1215,6 +1275,141 @@ int ltt_trace_stop(const char *trace_name)
 }
 EXPORT_SYMBOL_GPL(ltt_trace_stop);
 
+/*
+ * Flight recorder snapshots.
+ *
+ * A snapshot stops the writers of an active trace, switches out the current
+ * subbuffer of each channel buffer and marks the buffers finalized. The
+ * consumer then reads the frozen buffers through the per-cpu channel files,
+ * spliced without copy, and gets POLLHUP once they are drained. Resuming the
+ * trace lets writers fill (or overwrite) the buffers again. The trace stays
+ * started across the snapshot.
+ */
+
+static void ltt_trace_snapshot_channels(struct ltt_trace *trace)
+{
+	int i;
+
+	for (i = 0; i < trace->nr_channels; i++) {
+		struct ltt_chan *chan = &trace->channels[i];
+
+		if (chan->active)
+			trace->ops->snapshot_channel(chan);
+	}
+}
+
+/* must be called from within traces lock */
+static int _ltt_trace_snapshot(struct ltt_trace *trace)
+{
+	if (trace == NULL)
+		return -ENOENT;
+	if (!trace->active)
+		return -EPERM;
+	if (!trace->ops->snapshot_channel)
+		return -ENOSYS;
+
+	ltt_channels_trace_stop_timer(trace->channels, trace->nr_channels);
+	trace->active = 0;
+	trace->frozen = 1;
+	ltt_traces.num_active_traces--;
+	synchronize_sched(); /* Wait for each tracing to be finished */
+
+	ltt_trace_snapshot_channels(trace);
+	trace_async_wakeup(trace);
+	return 0;
+}
+
+int ltt_trace_snapshot(const char *trace_name)
+{
+	int err;
+
+	ltt_lock_traces();
+	err = _ltt_trace_snapshot(_ltt_trace_find(trace_name));
+	ltt_unlock_traces();
+	return err;
+}
+EXPORT_SYMBOL_GPL(ltt_trace_snapshot);
+
+/* must be called from within traces lock */
+static int _ltt_trace_snapshot_resume(struct ltt_trace *trace)
+{
+	if (trace == NULL)
+		return -ENOENT;
+	if (!trace->frozen)
+		return -EPERM;
+
+	ltt_trace_resume_channels(trace);
+	ltt_channels_trace_start_timer(trace->channels, trace->nr_channels);
+	trace->active = 1;
+	ltt_traces.num_active_traces++;
+	return 0;
+}
+
+int ltt_trace_snapshot_resume(const char *trace_name)
+{
+	int err;
+
+	ltt_lock_traces();
+	err = _ltt_trace_snapshot_resume(_ltt_trace_find(trace_name));
+	ltt_unlock_traces();
+	return err;
+}
+EXPORT_SYMBOL_GPL(ltt_trace_snapshot_resume);
+
+/*
+ * Only traces with overwrite channels are snapshot by the in-kernel trigger:
+ * the others are being consumed as they are written.
+ */
+static int ltt_trace_is_flight(struct ltt_trace *trace)
+{
+	int i;
+
+	for (i = 0; i < trace->nr_channels; i++)
+		if (trace->channels[i].active && trace->channels[i].overwrite)
+			return 1;
+	return 0;
+}
+
+static void ltt_snapshot_work(struct work_struct *work)
+{
+	struct ltt_trace *trace;
+
+	ltt_lock_traces();
+	list_for_each_entry(trace, &ltt_traces.head, list)
+		if (trace->active && ltt_trace_is_flight(trace))
+			_ltt_trace_snapshot(trace);
+	ltt_unlock_traces();
+}
+
+static DECLARE_WORK(ltt_snapshot_work_struct, ltt_snapshot_work);
+
+/*
+ * In-kernel trigger, see ltt_snapshot_trigger(). Outside of panic, the
+ * snapshot is taken from a work queue because stopping the writers needs to
+ * wait for a grace period. On panic, the other CPUs are already stopped and
+ * the buffers can be switched out right away; there is nobody left to read
+ * them, but they are preserved for post-mortem tools.
+ */
+static void ltt_snapshot_trigger_tracer(int from_panic)
+{
+	struct ltt_trace *trace;
+
+	if (!from_panic) {
+		schedule_work(&ltt_snapshot_work_struct);
+		return;
+	}
+
+	list_for_each_entry_rcu(trace, &ltt_traces.head, list) {
+		if (!trace->active || !ltt_trace_is_flight(trace)
+		    || !trace->ops->snapshot_channel)
+			continue;
+		trace->active = 0;
+		trace->frozen = 1;
+		ltt_traces.num_active_traces--;
+		ltt_trace_snapshot_channels(trace);
+	}
+}
+
 /**
  * ltt_control - Trace control in-kernel API
  * @msg: Action to perform
@@ -1308,6 +1503,7 @@ int __init ltt_init(void)
 	/* Make sure no page fault can be triggered by this module */
 	vmalloc_sync_all();
 	init_timer_deferrable(&ltt_async_wakeup_timer);
+	ltt_snapshot_register(ltt_snapshot_trigger_tracer);
 	return 0;
 }
 
@@ -1318,6 +1514,9 @@ static void __exit ltt_exit(void)
 	struct ltt_trace *trace;
 	struct list_head *pos, *n;
 
+	ltt_snapshot_unregister();
+	cancel_work_sync(&ltt_snapshot_work_struct);
+
 	ltt_lock_traces();
 	/* Stop each trace, currently being read by RCU read-side */
 	list_for_each_entry_rcu(trace, &ltt_traces.head, list)
@@ -120,6 +120,53 @@ static bool oom_unkillable_task(struct task_struct *p, struct mem_cgroup *mem,
 	return false;
 }
 
+#ifdef CONFIG_OOM_ADJ_INDEX
+struct hlist_head oom_adj_index[OOM_ADJ_INDEX_SIZE];
+EXPORT_SYMBOL_GPL(oom_adj_index);
+
+/*
+ * Index a new thread group leader under its oom_adj.
+ * The caller holds tasklist_lock for writing.
+ */
+void oom_adj_index_add(struct task_struct *p)
+{
+	hlist_add_head(&p->oom_adj_node, oom_adj_bucket(p->signal->oom_adj));
+}
+
+/*
+ * Drop a thread group leader that is being unhashed.
+ * The caller holds tasklist_lock for writing.
+ */
+void oom_adj_index_del(struct task_struct *p)
+{
+	hlist_del_init(&p->oom_adj_node);
+}
+
+/*
+ * An exec'ing thread is taking over the leadership of its thread group.
+ * The caller holds tasklist_lock for writing.
+ */
+void oom_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	hlist_del_init(&old->oom_adj_node);
+	oom_adj_index_add(new);
+}
+
+/* Rehash the thread group of p after its oom_adj was changed. */
+void oom_adj_index_update(struct task_struct *p)
+{
+	write_lock_irq(&tasklist_lock);
+	if (pid_alive(p)) {
+		p = p->group_leader;
+		if (!hlist_unhashed(&p->oom_adj_node)) {
+			hlist_del(&p->oom_adj_node);
+			oom_adj_index_add(p);
+		}
+	}
+	write_unlock_irq(&tasklist_lock);
+}
+#endif /* CONFIG_OOM_ADJ_INDEX */
+
 /**
  * badness - calculate a numeric value for how bad this task has been
  * @p: task struct of which task we should calculate
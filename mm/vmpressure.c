@@ -0,0 +1,306 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Memory pressure from reclaim efficiency.
+ *
+ * Reclaim reports how many pages it scanned and how many of those it
+ * managed to free.  Once a window's worth of pages has been scanned the
+ * ratio is turned into a pressure percentage and a level: a low ratio of
+ * reclaimed to scanned pages means the kernel is working hard for little
+ * memory, which is a better sign of trouble than the amount of free
+ * memory itself.
+ *
+ * Levels go to in-kernel listeners through a notifier chain, and to
+ * userspace through /proc/vmpressure: write "<eventfd> <level>" to an open
+ * instance of the file to have the eventfd signalled at that level or
+ * above for as long as the file stays open.  Reading it returns the last
+ * level and pressure.
+ *
+ * This file is released under the GPL v2.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/eventfd.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
+#include <linux/workqueue.h>
+
+/*
+ * Pages to scan before the pressure is computed.  Sixteen reclaim
+ * batches are enough to smooth out single unlucky batches while still
+ * reacting within a few milliseconds of hard reclaim.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/* Pressure, in percent, at which the medium and critical levels start */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * Reclaim priority at which we report critical pressure whatever the
+ * ratio is: scanning 1/8th of the LRU in one pass and still failing to
+ * meet the target means things are bad.
+ */
+static const int vmpressure_level_critical_prio = 3;
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+struct vmpressure {
+	spinlock_t sr_lock;		/* protects scanned and reclaimed */
+	unsigned long scanned;
+	unsigned long reclaimed;
+	enum vmpressure_levels level;	/* last reported */
+	unsigned long pressure;
+	struct work_struct work;
+};
+
+static void vmpressure_work_fn(struct work_struct *work);
+
+/* reclaim can run before initcalls, so this is set up statically */
+static struct vmpressure vmpressure_global = {
+	.sr_lock = __SPIN_LOCK_UNLOCKED(vmpressure_global.sr_lock),
+	.work = __WORK_INITIALIZER(vmpressure_global.work, vmpressure_work_fn),
+};
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+/* eventfds registered through /proc/vmpressure */
+struct vmpressure_event {
+	struct list_head node;
+	struct eventfd_ctx *efd;
+	enum vmpressure_levels level;
+};
+
+static LIST_HEAD(vmpressure_events);
+static DEFINE_MUTEX(vmpressure_events_lock);
+
+static enum vmpressure_levels vmpressure_level(unsigned long pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	unsigned long scale = scanned + reclaimed;
+	unsigned long pressure;
+
+	/* slab pages freed on the side can make up for all we scanned */
+	if (reclaimed >= scanned)
+		return 0;
+
+	/*
+	 * The fraction of scanned pages that were not reclaimed, scaled
+	 * so that the integer division keeps some precision.
+	 */
+	pressure = scale - (reclaimed * scale / scanned);
+	pressure = pressure * 100 / scale;
+
+	return pressure;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = container_of(work, struct vmpressure, work);
+	struct vmpressure_event *ev;
+	unsigned long scanned, reclaimed, pressure;
+	enum vmpressure_levels level;
+
+	spin_lock(&vmpr->sr_lock);
+	scanned = vmpr->scanned;
+	reclaimed = vmpr->reclaimed;
+	vmpr->scanned = 0;
+	vmpr->reclaimed = 0;
+	spin_unlock(&vmpr->sr_lock);
+
+	/* several calls may have queued us for the same window */
+	if (!scanned)
+		return;
+
+	pressure = vmpressure_calc(scanned, reclaimed);
+	level = vmpressure_level(pressure);
+	vmpr->pressure = pressure;
+	vmpr->level = level;
+
+	mutex_lock(&vmpressure_events_lock);
+	list_for_each_entry(ev, &vmpressure_events, node)
+		if (level >= ev->level)
+			eventfd_signal(ev->efd, 1);
+	mutex_unlock(&vmpressure_events_lock);
+
+	blocking_notifier_call_chain(&vmpressure_notifier, level,
+				     (void *)pressure);
+}
+
+/**
+ * vmpressure() - account reclaim efficiency
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from the global reclaim paths after each zone pass.  Cheap: the
+ * pressure is computed and reported from a work item once enough pages
+ * have been scanned.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	struct vmpressure *vmpr = &vmpressure_global;
+
+	/*
+	 * Only allocations that could have used the pages we are failing
+	 * to find tell us anything about pressure on the system.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpr->sr_lock);
+	vmpr->scanned += scanned;
+	vmpr->reclaimed += reclaimed;
+	scanned = vmpr->scanned;
+	spin_unlock(&vmpr->sr_lock);
+
+	if (scanned < vmpressure_win)
+		return;
+	schedule_work(&vmpr->work);
+}
+
+/**
+ * vmpressure_prio() - account reclaim priority
+ * @gfp:	reclaimer's gfp mask
+ * @prio:	reclaimer's priority
+ *
+ * Reclaim that has had to drop to a low priority reports a full window
+ * of scanned pages with nothing reclaimed, i.e. critical pressure.
+ */
+void vmpressure_prio(gfp_t gfp, int prio)
+{
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	vmpressure(gfp, vmpressure_win, 0);
+}
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
+
+static void vmpressure_event_free(struct vmpressure_event *ev)
+{
+	eventfd_ctx_put(ev->efd);
+	kfree(ev);
+}
+
+static ssize_t vmpressure_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vmpressure *vmpr = &vmpressure_global;
+	char tmp[32];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "%s %lu\n",
+		       vmpressure_str_levels[vmpr->level], vmpr->pressure);
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t vmpressure_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct vmpressure_event *ev, *old;
+	struct eventfd_ctx *efd;
+	char tmp[32], level[16];
+	int fd, i;
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+
+	if (sscanf(tmp, "%d %15s", &fd, level) != 2)
+		return -EINVAL;
+
+	for (i = 0; i < VMPRESSURE_NUM_LEVELS; i++)
+		if (!strcmp(level, vmpressure_str_levels[i]))
+			break;
+	if (i == VMPRESSURE_NUM_LEVELS)
+		return -EINVAL;
+
+	efd = eventfd_ctx_fdget(fd);
+	if (IS_ERR(efd))
+		return PTR_ERR(efd);
+
+	ev = kmalloc(sizeof(*ev), GFP_KERNEL);
+	if (!ev) {
+		eventfd_ctx_put(efd);
+		return -ENOMEM;
+	}
+	ev->efd = efd;
+	ev->level = i;
+
+	/* one registration per open file, a new one replaces the old */
+	mutex_lock(&vmpressure_events_lock);
+	old = file->private_data;
+	if (old)
+		list_del(&old->node);
+	list_add(&ev->node, &vmpressure_events);
+	file->private_data = ev;
+	mutex_unlock(&vmpressure_events_lock);
+
+	if (old)
+		vmpressure_event_free(old);
+	return count;
+}
+
+static int vmpressure_release(struct inode *inode, struct file *file)
+{
+	struct vmpressure_event *ev = file->private_data;
+
+	if (ev) {
+		mutex_lock(&vmpressure_events_lock);
+		list_del(&ev->node);
+		mutex_unlock(&vmpressure_events_lock);
+		vmpressure_event_free(ev);
+	}
+	return 0;
+}
+
+static const struct file_operations proc_vmpressure_operations = {
+	.read		= vmpressure_read,
+	.write		= vmpressure_write,
+	.release	= vmpressure_release,
+};
+
+static int __init vmpressure_init(void)
+{
+	proc_create("vmpressure", S_IRUGO | S_IWUSR, NULL,
+		    &proc_vmpressure_operations);
+	return 0;
+}
+module_init(vmpressure_init);